@@ -0,0 +1,360 @@
+/**
+ * @file msgpack-lite_benchmark.cpp
+ * @author  Arturo Blas Jiménez <arturoblas@gmail.com>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * \GPLv3
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \Apache 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ */
+
+#include "msgpack/msgpack-lite.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <sstream>
+
+using namespace msgpack_lite;
+
+/*
+ --------------------------------------------------------------------
+ WORKLOADS
+ Each workload packs and unpacks a fixed set of top level messages.
+ --------------------------------------------------------------------
+ */
+
+//! Deterministic pseudo random numbers, so that runs are comparable
+inline uint32_t nextRandom(uint32_t& seed)
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed >> 1;
+}
+
+template<typename T>
+struct ScalarWorkload
+{
+	std::vector<T> values;
+
+	std::size_t messages() const {
+		return values.size();
+	}
+
+	void pack(Packer& packer) const {
+		for (std::size_t i = 0; i < values.size(); i++)
+			packer.pack(values[i]);
+	}
+
+	void unpack(Unpacker& unpacker) {
+		T value;
+		for (std::size_t i = 0; i < values.size(); i++) {
+			unpacker.unpack(value);
+			benchmark::DoNotOptimize(value);
+		}
+	}
+};
+
+struct SmallInts: ScalarWorkload<int>
+{
+	SmallInts() {
+		for (int i = 0; i < 1024; i++)
+			values.push_back(i % 128);
+	}
+};
+
+struct MixedInts: ScalarWorkload<int64_t>
+{
+	MixedInts() {
+		uint32_t seed = 1;
+		for (int i = 0; i < 1024; i++) {
+			int64_t value = nextRandom(seed);
+			int bits = nextRandom(seed) % 63;
+			value = (value << 31 | nextRandom(seed)) >> (62 - bits);
+			values.push_back((i % 2) ? value : -value);
+		}
+	}
+};
+
+struct Floats: ScalarWorkload<float>
+{
+	Floats() {
+		for (int i = 0; i < 1024; i++)
+			values.push_back(i * 0.25f);
+	}
+};
+
+struct Doubles: ScalarWorkload<double>
+{
+	Doubles() {
+		for (int i = 0; i < 1024; i++)
+			values.push_back(i * 0.125);
+	}
+};
+
+struct ShortStrings: ScalarWorkload<std::string>
+{
+	ShortStrings() {
+		uint32_t seed = 1;
+		for (int i = 0; i < 256; i++)
+			values.push_back(std::string(8 + nextRandom(seed) % 17, 'a' + i % 26));
+	}
+};
+
+struct LongStrings: ScalarWorkload<std::string>
+{
+	LongStrings() {
+		for (int i = 0; i < 16; i++)
+			values.push_back(std::string(64 * 1024, 'a' + i));
+	}
+};
+
+struct FloatArray: ScalarWorkload<std::vector<float> >
+{
+	FloatArray() {
+		values.push_back(std::vector<float>());
+		for (int i = 0; i < 16 * 1024; i++)
+			values.back().push_back(i * 0.5f);
+	}
+};
+
+struct DoubleArray: ScalarWorkload<std::vector<double> >
+{
+	DoubleArray() {
+		values.push_back(std::vector<double>());
+		for (int i = 0; i < 16 * 1024; i++)
+			values.back().push_back(i * 0.25);
+	}
+};
+
+struct SmallIntArray: ScalarWorkload<std::vector<int> >
+{
+	SmallIntArray() {
+		values.push_back(std::vector<int>());
+		for (int i = 0; i < 16 * 1024; i++)
+			values.back().push_back(i % 160 - 32);
+	}
+};
+
+struct NestedMap: ScalarWorkload<std::map<std::string, std::vector<int> > >
+{
+	NestedMap() {
+		values.push_back(std::map<std::string, std::vector<int> >());
+		uint32_t seed = 1;
+		for (int i = 0; i < 64; i++) {
+			std::stringstream key;
+			key << "field_" << i;
+			std::vector<int>& vec = values.back()[key.str()];
+			for (int j = 0; j < 64; j++)
+				vec.push_back(nextRandom(seed) % 100000);
+		}
+	}
+};
+
+//! Dynamic decoding of a payload into one Object per message
+template<typename Workload>
+struct ObjectWorkload: Workload
+{
+	void unpack(Unpacker& unpacker) {
+		for (std::size_t i = 0; i < this->messages(); i++) {
+			Object* obj = unpacker.unpack();
+			benchmark::DoNotOptimize(obj);
+			delete obj;
+		}
+	}
+};
+
+typedef ObjectWorkload<SmallInts> SmallIntsObject;
+typedef ObjectWorkload<MixedInts> MixedIntsObject;
+typedef ObjectWorkload<ShortStrings> ShortStringsObject;
+
+//! Dynamic decoding of the NestedMap payload into Object trees
+struct NestedMapObject: NestedMap
+{
+	void unpack(Unpacker& unpacker) {
+		Object* obj = unpacker.unpack();
+		benchmark::DoNotOptimize(obj);
+		delete obj;
+	}
+};
+
+//! Dynamic decoding of the NestedMap payload into an Arena
+struct NestedMapArena: NestedMap
+{
+	Arena arena;
+
+	void unpack(Unpacker& unpacker) {
+		Object* obj = unpacker.unpack(arena);
+		benchmark::DoNotOptimize(obj);
+		arena.reset();
+	}
+};
+
+//! Dynamic decoding of the NestedMap payload into a Value
+struct NestedMapValue: NestedMap
+{
+	Arena arena;
+
+	void unpack(Unpacker& unpacker) {
+		Value value;
+		unpacker.unpack(value, arena);
+		benchmark::DoNotOptimize(value);
+		arena.reset();
+	}
+};
+
+/*
+ --------------------------------------------------------------------
+ BENCHMARKS
+ Throughput is reported both in bytes and in messages per second.
+ --------------------------------------------------------------------
+ */
+
+template<typename Workload>
+void report(benchmark::State& state, const Workload& workload, std::size_t bytes)
+{
+	state.SetBytesProcessed(state.iterations() * bytes);
+	state.SetItemsProcessed(state.iterations() * workload.messages());
+}
+
+template<typename Workload>
+std::string encode(const Workload& workload)
+{
+	BufferPacker<> packer;
+	workload.pack(packer);
+	return std::string(packer.data(), packer.size());
+}
+
+template<typename Workload>
+void BM_PackStream(benchmark::State& state)
+{
+	Workload workload;
+	std::stringstream ss;
+	for (auto _ : state) {
+		ss.str(std::string());
+		ss.clear();
+		Packer packer(ss);
+		workload.pack(packer);
+	}
+	report(state, workload, encode(workload).size());
+}
+
+template<typename Workload>
+void BM_PackBuffer(benchmark::State& state)
+{
+	Workload workload;
+	BufferPacker<> packer;
+	for (auto _ : state) {
+		packer.clear();
+		workload.pack(packer);
+		benchmark::ClobberMemory();
+	}
+	report(state, workload, packer.size());
+}
+
+template<typename Workload>
+void BM_UnpackStream(benchmark::State& state)
+{
+	Workload workload;
+	std::string data = encode(workload);
+	std::stringstream ss;
+	for (auto _ : state) {
+		ss.str(data);
+		ss.clear();
+		Unpacker unpacker(ss);
+		workload.unpack(unpacker);
+	}
+	report(state, workload, data.size());
+}
+
+template<typename Workload>
+void BM_UnpackBuffer(benchmark::State& state)
+{
+	Workload workload;
+	std::string data = encode(workload);
+	for (auto _ : state) {
+		Unpacker unpacker(data.data(), data.size());
+		workload.unpack(unpacker);
+	}
+	report(state, workload, data.size());
+}
+
+template<typename Workload>
+void BM_Validate(benchmark::State& state)
+{
+	Workload workload;
+	std::string data = encode(workload);
+	Validator validator;
+	for (auto _ : state) {
+		for (std::size_t offset = 0; offset < data.size();)
+			offset += validator.validate(data.data() + offset, data.size() - offset);
+	}
+	report(state, workload, data.size());
+}
+
+#define PACK_BENCHMARKS(__WORKLOAD__) \
+	BENCHMARK_TEMPLATE(BM_PackStream, __WORKLOAD__); \
+	BENCHMARK_TEMPLATE(BM_PackBuffer, __WORKLOAD__);
+
+#define UNPACK_BENCHMARKS(__WORKLOAD__) \
+	BENCHMARK_TEMPLATE(BM_UnpackStream, __WORKLOAD__); \
+	BENCHMARK_TEMPLATE(BM_UnpackBuffer, __WORKLOAD__);
+
+PACK_BENCHMARKS(SmallInts)
+PACK_BENCHMARKS(MixedInts)
+PACK_BENCHMARKS(Floats)
+PACK_BENCHMARKS(Doubles)
+PACK_BENCHMARKS(ShortStrings)
+PACK_BENCHMARKS(LongStrings)
+PACK_BENCHMARKS(FloatArray)
+PACK_BENCHMARKS(DoubleArray)
+PACK_BENCHMARKS(SmallIntArray)
+PACK_BENCHMARKS(NestedMap)
+
+UNPACK_BENCHMARKS(SmallInts)
+UNPACK_BENCHMARKS(MixedInts)
+UNPACK_BENCHMARKS(Floats)
+UNPACK_BENCHMARKS(Doubles)
+UNPACK_BENCHMARKS(ShortStrings)
+UNPACK_BENCHMARKS(LongStrings)
+UNPACK_BENCHMARKS(FloatArray)
+UNPACK_BENCHMARKS(DoubleArray)
+UNPACK_BENCHMARKS(SmallIntArray)
+UNPACK_BENCHMARKS(NestedMap)
+UNPACK_BENCHMARKS(SmallIntsObject)
+UNPACK_BENCHMARKS(MixedIntsObject)
+UNPACK_BENCHMARKS(ShortStringsObject)
+UNPACK_BENCHMARKS(NestedMapObject)
+UNPACK_BENCHMARKS(NestedMapArena)
+UNPACK_BENCHMARKS(NestedMapValue)
+
+BENCHMARK_TEMPLATE(BM_Validate, SmallInts);
+BENCHMARK_TEMPLATE(BM_Validate, ShortStrings);
+BENCHMARK_TEMPLATE(BM_Validate, SmallIntArray);
+BENCHMARK_TEMPLATE(BM_Validate, FloatArray);
+BENCHMARK_TEMPLATE(BM_Validate, NestedMap);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,261 @@
+/**
+ * @file msgpack-lite-coro.hpp
+ * @author  Arturo Blas Jiménez <arturoblas@gmail.com>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * \GPLv3
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \Apache 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @section DESCRIPTION
+ *
+ *  This header file provides an unpacker which C++20 coroutines can
+ *  await, for data arriving from non-blocking sockets. It requires
+ *  C++20.
+ *
+ */
+
+#ifndef _MSGPACK_LITE_CORO_HPP_
+#define _MSGPACK_LITE_CORO_HPP_
+
+#include "msgpack-lite.hpp"
+
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "msgpack-lite-coro.hpp requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+namespace MSGPACK_NAMESPACE__
+{
+
+/**
+ * AsyncUnpacker class. Lets a coroutine unpack the messages of a
+ * connection with co_await next(), suspending it until the I/O layer
+ * has fed the whole message, so no thread is blocked waiting for data:
+ *
+ *   Object* obj = co_await unpacker.next();
+ *   Point p = co_await unpacker.next<Point>();
+ *
+ * Messages are framed with a {@see Validator} as the data arrives, and
+ * then unpacked at once. The validation of a message still incomplete
+ * resumes where it stopped each time more data arrives, so messages
+ * fed in many small pieces are still checked in linear time. Only one
+ * coroutine may await at a time, and it is resumed from within feed()
+ * or close().
+ */
+class AsyncUnpacker
+{
+  public:
+
+    /**
+     * Awaitable result of next(), giving the next message
+     * unpacked as a T.
+     */
+    template<typename T>
+    class Next
+    {
+      public:
+
+        bool await_ready()
+        {
+          return unpacker_.ready();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+          if (unpacker_.waiting_)
+            throw unpack_exception("Another coroutine is already waiting");
+          unpacker_.waiting_ = handle;
+        }
+
+        T await_resume()
+        {
+          T value;
+          unpacker_.take(value);
+          return value;
+        }
+
+      private:
+
+        explicit Next(AsyncUnpacker& unpacker) : unpacker_(unpacker) {}
+
+        AsyncUnpacker& unpacker_;
+
+        friend class AsyncUnpacker;
+    };
+
+    /**
+     * Constructor
+     * @param validator Validator framing the messages, which sets
+     * the limits of their depth and length
+     */
+    explicit AsyncUnpacker(const Validator& validator = Validator()) :
+      validator_(validator), pos_(0), length_(0), checked_(0), closed_(false) {}
+
+    /**
+     * Append data received, resuming the waiting coroutine if it
+     * completes a message.
+     * @param data Pointer to the data
+     * @param length Length of the data in bytes
+     */
+    void feed(const char* data, std::size_t length)
+    {
+      // Drop the messages already unpacked
+      if (pos_ == buffer_.size() || pos_ > buffer_.size() / 2)
+      {
+        buffer_.erase(buffer_.begin(), buffer_.begin() + pos_);
+        pos_ = 0;
+      }
+      buffer_.insert(buffer_.end(), data, data + length);
+      resume();
+    }
+
+    /**
+     * Signal the end of the data, e.g. when the connection is closed.
+     * Awaiting a message which is not complete throws an
+     * unpack_exception from then on.
+     */
+    void close()
+    {
+      closed_ = true;
+      resume();
+    }
+
+    /**
+     * Await the next message, unpacked into a new Object which should
+     * be deleted by the caller.
+     */
+    Next<Object*> next()
+    {
+      return Next<Object*>(*this);
+    }
+
+    /**
+     * Await the next message, unpacked into a T as with
+     * {@see Unpacker::unpack(T&)}.
+     */
+    template<typename T>
+    Next<T> next()
+    {
+      return Next<T>(*this);
+    }
+
+    //! Number of bytes received and not unpacked yet
+    std::size_t buffered() const
+    {
+      return buffer_.size() - pos_;
+    }
+
+    //! Returns true if a coroutine is waiting for a message
+    bool waiting() const
+    {
+      return bool(waiting_);
+    }
+
+  private:
+
+    AsyncUnpacker(const AsyncUnpacker&);
+    AsyncUnpacker& operator=(const AsyncUnpacker&);
+
+    //! Resume the waiting coroutine, if it has something to take
+    void resume()
+    {
+      if (waiting_ && ready())
+      {
+        std::coroutine_handle<> handle = waiting_;
+        waiting_ = nullptr;
+        handle.resume();
+      }
+    }
+
+    //! Returns true if a message is complete, or there will never be one
+    bool ready()
+    {
+      if (length_ > 0 || error_)
+        return true;
+
+      if (buffered() > checked_)
+      {
+        try
+        {
+          length_ = validator_.validate(&buffer_[pos_], buffered(), state_);
+        }
+        catch (...)
+        {
+          error_ = std::current_exception();
+          return true;
+        }
+        checked_ = buffered();
+      }
+      return length_ > 0 || closed_;
+    }
+
+    //! Unpack the message framed by ready()
+    template<typename T>
+    void take(T& value)
+    {
+      if (error_)
+        std::rethrow_exception(error_);
+      if (length_ == 0)
+        throw unpack_exception("Reached end of stream");
+
+      Unpacker unpacker(&buffer_[pos_], length_);
+      pos_ += length_;
+      length_ = 0;
+      checked_ = 0;
+      state_.reset();
+      unpack(unpacker, value);
+    }
+
+    static void unpack(Unpacker& unpacker, Object*& obj)
+    {
+      obj = unpacker.unpack();
+    }
+
+    template<typename T>
+    static void unpack(Unpacker& unpacker, T& value)
+    {
+      unpacker.unpack(value);
+    }
+
+    Validator validator_;              //!< Frames the messages
+    Validator::State state_;           //!< Progress of the framing of the next message
+    std::vector<char> buffer_;         //!< Data received
+    std::size_t pos_;                  //!< Start of the next message
+    std::size_t length_;               //!< Length of the next message, if complete
+    std::size_t checked_;              //!< Bytes of the next message fed to the Validator
+    bool closed_;                      //!< Whether the end of the data was signaled
+    std::exception_ptr error_;         //!< Why the data can not be unpacked
+    std::coroutine_handle<> waiting_;  //!< The coroutine waiting for a message
+
+}; // AsyncUnpacker
+
+} // namespace MSGPACK_NAMESPACE__
+
+#endif // _MSGPACK_LITE_CORO_HPP_
@@ -0,0 +1,668 @@
+/**
+ * @file msgpack-lite-log.hpp
+ * @author  Arturo Blas Jiménez <arturoblas@gmail.com>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * \GPLv3
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \Apache 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @section DESCRIPTION
+ *
+ *  This header file provides a record log format for archiving
+ *  MessagePack records: the records are grouped into blocks, each
+ *  one compressed on its own with a pluggable codec and checked
+ *  with a checksum, and indexed at the end of the log for random
+ *  access. From C++11 on, blocks can be decoded on several threads.
+ *
+ */
+
+#ifndef _MSGPACK_LITE_LOG_HPP_
+#define _MSGPACK_LITE_LOG_HPP_
+
+#include "msgpack-lite.hpp"
+
+#if __cplusplus >= 201103L
+#include "msgpack-lite-parallel.hpp"
+#endif
+
+namespace MSGPACK_NAMESPACE__
+{
+
+/**
+ * Codec class. Interface of the compression algorithms of the blocks
+ * of a log. Codecs are identified in the block headers by their id,
+ * 0 and 1 being taken by {@see StoreCodec} and {@see LzCodec}. Their
+ * methods may be called from several threads at once.
+ */
+class Codec
+{
+  public:
+
+    virtual ~Codec() {}
+
+    //! Identifier of the codec in the block headers
+    virtual uint8_t id() const = 0;
+
+    /**
+     * Compress the given data
+     * @param data Pointer to the data
+     * @param length Length of the data in bytes
+     * @param out Where the compressed data is stored
+     */
+    virtual void compress(const char* data, std::size_t length, std::vector<char>& out) const = 0;
+
+    /**
+     * Decompress the given data, throwing an unpack_exception if
+     * it is corrupted.
+     * @param data Pointer to the compressed data
+     * @param length Length of the compressed data in bytes
+     * @param out Where the data is decompressed
+     * @param outLength Length of the decompressed data in bytes
+     */
+    virtual void decompress(const char* data, std::size_t length,
+        char* out, std::size_t outLength) const MSGPACK_THROW__(unpack_exception) = 0;
+};
+
+/**
+ * StoreCodec class. Keeps the data as it is.
+ */
+class StoreCodec : public Codec
+{
+  public:
+
+    enum { ID = 0 };
+
+    uint8_t id() const
+    {
+      return ID;
+    }
+
+    void compress(const char* data, std::size_t length, std::vector<char>& out) const
+    {
+      out.assign(data, data + length);
+    }
+
+    void decompress(const char* data, std::size_t length,
+        char* out, std::size_t outLength) const MSGPACK_THROW__(unpack_exception)
+    {
+      if (length != outLength)
+        throw unpack_exception("Corrupted block in the log");
+      std::memcpy(out, data, length);
+    }
+};
+
+/**
+ * LzCodec class. Byte oriented LZ77 compression in the spirit of LZ4,
+ * favouring speed over ratio, which suits the repeated map keys and
+ * small values of MessagePack records. The data is a sequence of runs
+ * of literals, each one followed by a match of at least 4 bytes
+ * copied from up to 64KB behind, except for the last one.
+ */
+class LzCodec : public Codec
+{
+  public:
+
+    enum { ID = 1 };
+
+    uint8_t id() const
+    {
+      return ID;
+    }
+
+    void compress(const char* data, std::size_t length, std::vector<char>& out) const
+    {
+      out.clear();
+      out.reserve(length + length / 255 + 16);
+
+      // Last position + 1 of each hash of 4 bytes
+      std::vector<uint32_t> table(std::size_t(1) << HASH_BITS, 0);
+      std::size_t anchor = 0;
+      std::size_t pos = 0;
+      while (pos + MIN_MATCH <= length)
+      {
+        uint32_t sequence;
+        std::memcpy(&sequence, data + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        std::size_t candidate = table[hash];
+        table[hash] = uint32_t(pos + 1);
+
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+            std::memcmp(data + candidate - 1, data + pos, MIN_MATCH) != 0)
+        {
+          // Go faster over data which does not compress
+          pos += 1 + ((pos - anchor) >> 6);
+          continue;
+        }
+
+        std::size_t match = candidate - 1;
+        std::size_t size = MIN_MATCH;
+        while (pos + size < length && data[match + size] == data[pos + size])
+          size++;
+
+        putSequence(out, data + anchor, pos - anchor, size);
+        out.push_back(char((pos - match) >> 8));
+        out.push_back(char(pos - match));
+        putLength(out, size - MIN_MATCH);
+
+        pos += size;
+        anchor = pos;
+      }
+      putSequence(out, data + anchor, length - anchor, 0);
+    }
+
+    void decompress(const char* data, std::size_t length,
+        char* out, std::size_t outLength) const MSGPACK_THROW__(unpack_exception)
+    {
+      const char* end = data + length;
+      std::size_t pos = 0;
+      while (data != end)
+      {
+        uint8_t token = *data++;
+        std::size_t literals = getLength(data, end, token >> 4);
+        if (std::size_t(end - data) < literals || outLength - pos < literals)
+          throw unpack_exception("Corrupted block in the log");
+
+        std::memcpy(out + pos, data, literals);
+        data += literals;
+        pos += literals;
+        if (data == end)
+          break;
+
+        if (end - data < 2)
+          throw unpack_exception("Corrupted block in the log");
+        std::size_t offset = (std::size_t((uint8_t) data[0]) << 8) | (uint8_t) data[1];
+        data += 2;
+
+        std::size_t size = getLength(data, end, token & 0x0f) + MIN_MATCH;
+        if (offset == 0 || offset > pos || outLength - pos < size)
+          throw unpack_exception("Corrupted block in the log");
+
+        // Matches may overlap the bytes they produce
+        for (const char* from = out + pos - offset; size > 0; size--)
+          out[pos++] = *from++;
+      }
+
+      if (pos != outLength)
+        throw unpack_exception("Corrupted block in the log");
+    }
+
+  private:
+
+    enum { HASH_BITS = 12, MIN_MATCH = 4, MAX_OFFSET = 65535 };
+
+    //! Add the token of a sequence and its literals
+    static void putSequence(std::vector<char>& out, const char* literals,
+        std::size_t count, std::size_t size)
+    {
+      std::size_t extra = size > 0 ? size - MIN_MATCH : 0;
+      out.push_back(char(((count < 15 ? count : 15) << 4) | (extra < 15 ? extra : 15)));
+      putLength(out, count);
+      out.insert(out.end(), literals, literals + count);
+    }
+
+    //! Add the bytes of a length beyond what the token holds
+    static void putLength(std::vector<char>& out, std::size_t length)
+    {
+      if (length < 15)
+        return;
+
+      for (length -= 15; length >= 255; length -= 255)
+        out.push_back(char(255));
+      out.push_back(char(length));
+    }
+
+    //! Read a length, given the part of it held by the token
+    static std::size_t getLength(const char*& data, const char* end, std::size_t length)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      if (length < 15)
+        return length;
+
+      uint8_t byte;
+      do
+      {
+        if (data == end)
+          throw unpack_exception("Corrupted block in the log");
+        byte = *data++;
+        length += byte;
+      }
+      while (byte == 255);
+      return length;
+    }
+};
+
+namespace detail
+{
+
+//! Adler-32 checksum of the given data
+inline uint32_t adler32(const char* data, std::size_t length)
+{
+  uint32_t a = 1;
+  uint32_t b = 0;
+  while (length > 0)
+  {
+    // Largest number of bytes before the sums might overflow
+    std::size_t count = length < 5552 ? length : 5552;
+    length -= count;
+    for (; count > 0; count--)
+    {
+      a += (uint8_t) *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+//! Layout of the log format, all integers being in network byte order
+struct log_format
+{
+  static const char* magic()
+  {
+    return "MPLLOG01";
+  }
+
+  enum
+  {
+    MAGIC_SIZE = 8,
+    /** Records, size, compressed size, checksum, codec and 3 reserved bytes */
+    BLOCK_HEADER_SIZE = 20,
+    /** Offset of the index, number of blocks and the magic */
+    TRAILER_SIZE = 24
+  };
+};
+
+} // namespace detail
+
+/**
+ * LogWriter class. Writes records into a log: they are packed into
+ * blocks of about the given size, which are compressed with the given
+ * codec and written as they fill up, followed on close() by the index
+ * of the blocks. Blocks which do not compress are stored as they are.
+ *
+ *   magic | block... | offset of each block | index offset | blocks | magic
+ *
+ * Each block starts with a header holding its number of records, its
+ * size before and after compression, the Adler-32 checksum of its data
+ * before compression and the id of its codec.
+ */
+class LogWriter
+{
+  public:
+
+    /**
+     * Constructor. Writes the header of the log.
+     * @param out Stream the log is written into
+     * @param blockSize Size the blocks are closed at, before compression
+     * @param codec Codec compressing the blocks, a {@see LzCodec} by
+     * default, which must outlive the writer
+     */
+    explicit LogWriter(std::ostream& out, std::size_t blockSize = 64 * 1024,
+        const Codec* codec = 0) MSGPACK_THROW__(pack_exception) :
+      out_(out), blockSize_(blockSize), codec_(codec ? codec : &lz_),
+      records_(0), offset_(0), closed_(false)
+    {
+      write(detail::log_format::magic(), detail::log_format::MAGIC_SIZE);
+    }
+
+    /**
+     * Destructor. Closes the log if it was not.
+     */
+    ~LogWriter()
+    {
+      try
+      {
+        close();
+      }
+      catch (...)
+      {
+      }
+    }
+
+    /**
+     * Add a record to the log
+     * @param record Reference to the record
+     */
+    template<typename T>
+    LogWriter& write(const T& record) MSGPACK_THROW__(pack_exception)
+    {
+      if (closed_)
+        throw pack_exception("The log is closed");
+
+      packer_.pack(record);
+      records_++;
+      if (packer_.size() >= blockSize_)
+        flush();
+      return *this;
+    }
+
+    /**
+     * Write the records added so far as a block
+     */
+    void flush() MSGPACK_THROW__(pack_exception)
+    {
+      if (records_ == 0)
+        return;
+      if (packer_.size() > 0xffffffffu)
+        throw pack_exception("Block too large for the log");
+
+      const Codec* codec = codec_;
+      codec->compress(packer_.data(), packer_.size(), compressed_);
+      if (compressed_.size() >= packer_.size())
+      {
+        codec = &store_;
+        compressed_.assign(packer_.data(), packer_.data() + packer_.size());
+      }
+
+      char header[detail::log_format::BLOCK_HEADER_SIZE] = { 0 };
+      detail::store_network<uint32_t>(header, uint32_t(records_));
+      detail::store_network<uint32_t>(header + 4, uint32_t(packer_.size()));
+      detail::store_network<uint32_t>(header + 8, uint32_t(compressed_.size()));
+      detail::store_network<uint32_t>(header + 12, detail::adler32(packer_.data(), packer_.size()));
+      header[16] = (char) codec->id();
+
+      offsets_.push_back(offset_);
+      write(header, sizeof(header));
+      if (!compressed_.empty())
+        write(&compressed_[0], compressed_.size());
+
+      packer_.clear();
+      records_ = 0;
+    }
+
+    /**
+     * Write the last block and the index, which completes the log.
+     */
+    void close() MSGPACK_THROW__(pack_exception)
+    {
+      if (closed_)
+        return;
+
+      flush();
+      closed_ = true;
+
+      uint64_t indexOffset = offset_;
+      char entry[8];
+      for (std::size_t i = 0; i < offsets_.size(); i++)
+      {
+        detail::store_network<uint64_t>(entry, offsets_[i]);
+        write(entry, sizeof(entry));
+      }
+
+      char trailer[detail::log_format::TRAILER_SIZE];
+      detail::store_network<uint64_t>(trailer, indexOffset);
+      detail::store_network<uint64_t>(trailer + 8, offsets_.size());
+      std::memcpy(trailer + 16, detail::log_format::magic(), detail::log_format::MAGIC_SIZE);
+      write(trailer, sizeof(trailer));
+      out_.flush();
+    }
+
+    //! Number of blocks written so far
+    std::size_t blocks() const
+    {
+      return offsets_.size();
+    }
+
+  private:
+
+    LogWriter(const LogWriter&);
+    LogWriter& operator=(const LogWriter&);
+
+    void write(const char* data, std::size_t length) MSGPACK_THROW__(pack_exception)
+    {
+      out_.write(data, length);
+      if (!out_)
+        throw pack_exception("Unable to write the log");
+      offset_ += length;
+    }
+
+    std::ostream& out_;              //!< Where the log is written
+    std::size_t blockSize_;          //!< Size the blocks are closed at
+    LzCodec lz_;                     //!< The default codec
+    StoreCodec store_;               //!< Codec of the blocks which do not compress
+    const Codec* codec_;             //!< Codec compressing the blocks
+    BufferPacker<> packer_;          //!< Records of the open block
+    std::size_t records_;            //!< Number of records of the open block
+    std::vector<char> compressed_;   //!< Compressed data of the last block
+    std::vector<uint64_t> offsets_;  //!< Offsets of the blocks written
+    uint64_t offset_;                //!< Bytes written so far
+    bool closed_;                    //!< Whether the index was written
+
+}; // LogWriter
+
+/**
+ * LogReader class. Gives random access to the blocks of a log held
+ * in memory, e.g. by a {@see MappedReader}, which must outlive it.
+ * Blocks are checked against their checksum once decompressed, and
+ * const methods can be called from several threads at once.
+ */
+class LogReader
+{
+  public:
+
+    /**
+     * Constructor. Reads the index of the log, an unpack_exception
+     * being thrown if the log is not complete or is corrupted.
+     * @param data Pointer to the log
+     * @param length Length of the log in bytes
+     * @param maxBlockSize Largest block decompressed, in bytes
+     */
+    LogReader(const char* data, std::size_t length, std::size_t maxBlockSize = 256 << 20)
+      MSGPACK_THROW__(unpack_exception) :
+      codecs_(256, (const Codec*) 0), records_(0), maxBlockSize_(maxBlockSize)
+    {
+      using detail::log_format;
+
+      addCodec(store_);
+      addCodec(lz_);
+
+      if (length < std::size_t(log_format::MAGIC_SIZE + log_format::TRAILER_SIZE) ||
+          std::memcmp(data, log_format::magic(), log_format::MAGIC_SIZE) != 0 ||
+          std::memcmp(data + length - log_format::MAGIC_SIZE, log_format::magic(),
+              log_format::MAGIC_SIZE) != 0)
+        throw unpack_exception("Not a complete log");
+
+      const char* trailer = data + length - log_format::TRAILER_SIZE;
+      uint64_t indexOffset = detail::load_network<uint64_t>(trailer);
+      uint64_t count = detail::load_network<uint64_t>(trailer + 8);
+      uint64_t indexEnd = length - log_format::TRAILER_SIZE;
+      if (indexOffset < log_format::MAGIC_SIZE || indexOffset > indexEnd ||
+          (indexEnd - indexOffset) % 8 != 0 || count != (indexEnd - indexOffset) / 8)
+        throw unpack_exception("Corrupted index in the log");
+
+      blocks_.resize(count);
+      const char* index = data + indexOffset;
+      for (std::size_t i = 0; i < count; i++)
+      {
+        uint64_t offset = detail::load_network<uint64_t>(index + 8 * i);
+        if (offset < log_format::MAGIC_SIZE || offset > indexOffset ||
+            indexOffset - offset < log_format::BLOCK_HEADER_SIZE)
+          throw unpack_exception("Corrupted index in the log");
+
+        const char* header = data + offset;
+        Block& block = blocks_[i];
+        block.header = header;
+        block.first = records_;
+        block.records = detail::load_network<uint32_t>(header);
+        block.size = detail::load_network<uint32_t>(header + 4);
+        block.compressedSize = detail::load_network<uint32_t>(header + 8);
+        if (block.compressedSize > indexOffset - offset - log_format::BLOCK_HEADER_SIZE)
+          throw unpack_exception("Corrupted index in the log");
+        records_ += block.records;
+      }
+    }
+
+    /**
+     * Make the given codec available to decompress the blocks
+     * written with it, which must outlive the reader.
+     */
+    void addCodec(const Codec& codec)
+    {
+      codecs_[codec.id()] = &codec;
+    }
+
+    //! Number of blocks of the log
+    std::size_t blocks() const
+    {
+      return blocks_.size();
+    }
+
+    //! Number of records of the log
+    std::size_t records() const
+    {
+      return records_;
+    }
+
+    //! Number of records of the given block
+    std::size_t records(std::size_t block) const
+    {
+      return blocks_[block].records;
+    }
+
+    //! Number of the first record of the given block
+    std::size_t firstRecord(std::size_t block) const
+    {
+      return blocks_[block].first;
+    }
+
+    /**
+     * Decompress the given block, checking it against its checksum.
+     * @param block Number of the block
+     * @param out Where the records of the block are decompressed
+     */
+    void block(std::size_t block, std::vector<char>& out) const MSGPACK_THROW__(unpack_exception)
+    {
+      const Block& b = blocks_[block];
+      const Codec* codec = codecs_[(uint8_t) b.header[16]];
+      if (codec == 0)
+        throw unpack_exception("Unknown codec in the log");
+      if (b.size > maxBlockSize_)
+        throw unpack_exception("Block larger than the limit");
+
+      out.resize(b.size);
+      codec->decompress(b.header + detail::log_format::BLOCK_HEADER_SIZE, b.compressedSize,
+          out.empty() ? 0 : &out[0], out.size());
+
+      uint32_t checksum = detail::load_network<uint32_t>(b.header + 12);
+      if (detail::adler32(out.empty() ? 0 : &out[0], out.size()) != checksum)
+        throw unpack_exception("Checksum mismatch in the log");
+    }
+
+    /**
+     * Call f(unpacker, i) for every record i of the given block, each
+     * call getting its own zero copy Unpacker over the record.
+     * @param block Number of the block
+     * @param buffer Where the records of the block are decompressed,
+     * which the Raw objects unpacked point into
+     * @param f Function or functor taking an Unpacker& and a std::size_t
+     */
+    template<typename F>
+    void readBlock(std::size_t block, std::vector<char>& buffer, F& f) const
+      MSGPACK_THROW__(unpack_exception)
+    {
+      this->block(block, buffer);
+
+      const char* data = buffer.empty() ? 0 : &buffer[0];
+      std::size_t length = buffer.size();
+      std::size_t first = blocks_[block].first;
+      for (std::size_t i = 0; i < blocks_[block].records; i++)
+      {
+        Unpacker probe(data, length);
+        probe.skip();
+        std::size_t size = length - probe.remaining();
+
+        Unpacker unpacker(data, size, true);
+        f(unpacker, first + i);
+        data += size;
+        length -= size;
+      }
+      if (length != 0)
+        throw unpack_exception("Corrupted block in the log");
+    }
+
+    /**
+     * Call f(unpacker, i) for every record i of the log, in order
+     * @param f Function or functor taking an Unpacker& and a std::size_t
+     */
+    template<typename F>
+    void forEach(F f) const MSGPACK_THROW__(unpack_exception)
+    {
+      std::vector<char> buffer;
+      for (std::size_t i = 0; i < blocks_.size(); i++)
+        readBlock(i, buffer, f);
+    }
+
+  private:
+
+    //! Position and header fields of a block
+    struct Block
+    {
+      const char* header;
+      std::size_t first;
+      std::size_t records;
+      std::size_t size;
+      std::size_t compressedSize;
+    };
+
+    StoreCodec store_;                  //!< Built-in codecs
+    LzCodec lz_;
+    std::vector<const Codec*> codecs_;  //!< Codecs by id
+    std::vector<Block> blocks_;         //!< The blocks of the log
+    std::size_t records_;               //!< Number of records of the log
+    std::size_t maxBlockSize_;          //!< Largest block decompressed
+
+}; // LogReader
+
+#if __cplusplus >= 201103L
+/**
+ * Call f(unpacker, i) for every record i of the given log, spreading
+ * its blocks over the given number of threads. Each call gets its own
+ * zero copy Unpacker over the record, so f must be safe to run
+ * concurrently. The first exception thrown is rethrown once all the
+ * threads are done.
+ * @param log The log
+ * @param f Function or functor taking an Unpacker& and a std::size_t
+ * @param threads Number of threads to use, zero for one per core
+ */
+template<typename F>
+void forEachRecord(const LogReader& log, F f, unsigned threads = 0)
+{
+  auto blocks = [&](std::size_t begin, std::size_t end)
+  {
+    std::vector<char> buffer;
+    for (std::size_t i = begin; i < end; i++)
+      log.readBlock(i, buffer, f);
+  };
+  detail::parallel_for(log.blocks(), 1, threads, blocks);
+}
+#endif
+
+} // namespace MSGPACK_NAMESPACE__
+
+#endif // _MSGPACK_LITE_LOG_HPP_
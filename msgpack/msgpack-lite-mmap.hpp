@@ -0,0 +1,238 @@
+/**
+ * @file msgpack-lite-mmap.hpp
+ * @author  Arturo Blas Jiménez <arturoblas@gmail.com>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * \GPLv3
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \Apache 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @section DESCRIPTION
+ *
+ *  This header file provides a reader of files made of concatenated
+ *  MessagePack records, which maps them into memory and unpacks them
+ *  with no copies. It relies on the POSIX mmap() interface.
+ *
+ */
+
+#ifndef _MSGPACK_LITE_MMAP_HPP_
+#define _MSGPACK_LITE_MMAP_HPP_
+
+#include "msgpack-lite.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace MSGPACK_NAMESPACE__
+{
+
+/**
+ * MappedReader class. Maps a file of concatenated MessagePack records
+ * into memory and iterates them with a zero copy {@see Unpacker}, so
+ * that Raw objects and RawRef values point into the mapping. These
+ * remain valid as long as the reader.
+ * The kernel is advised that the file is read sequentially.
+ */
+class MappedReader
+{
+  public:
+
+    /**
+     * Constructor. Maps the given file, an unpack_exception
+     * being thrown should it fail.
+     * @param path Path of the file to be read
+     * @param offset Offset of the first record to be read
+     */
+    explicit MappedReader(const char* path, std::size_t offset = 0)
+      MSGPACK_THROW__(unpack_exception) :
+      data_(0), size_(0), unpacker_(0, 0, true)
+    {
+      int fd = ::open(path, O_RDONLY);
+      if (fd < 0)
+        throw unpack_exception("Unable to open the file");
+
+      struct stat st;
+      if (::fstat(fd, &st) != 0)
+      {
+        ::close(fd);
+        throw unpack_exception("Unable to get the size of the file");
+      }
+
+      size_ = st.st_size;
+      if (offset > size_)
+      {
+        ::close(fd);
+        throw unpack_exception("Offset past the end of the file");
+      }
+
+      if (size_ > 0)
+      {
+        void* data = ::mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+          ::close(fd);
+          throw unpack_exception("Unable to map the file");
+        }
+
+        data_ = (const char*) data;
+        ::madvise(data, size_, MADV_SEQUENTIAL);
+      }
+      ::close(fd);
+
+      seek(offset);
+    }
+
+    /**
+     * Destructor. Unmaps the file.
+     */
+    ~MappedReader()
+    {
+      if (data_ != 0)
+        ::munmap((void*) data_, size_);
+    }
+
+    /**
+     * Move to the record at the given offset, which can be obtained
+     * from offset() to resume reading later on.
+     * An unpack_exception is thrown if it is past the end of the file.
+     * The settings of unpacker() are kept.
+     */
+    void seek(std::size_t offset) MSGPACK_THROW__(unpack_exception)
+    {
+      if (offset > size_)
+        throw unpack_exception("Offset past the end of the file");
+
+      unpacker_.cur_ = data_ + offset;
+      unpacker_.end_ = data_ + size_;
+    }
+
+    /**
+     * Offset in the file of the next record
+     */
+    std::size_t offset() const
+    {
+      return size_ - unpacker_.remaining();
+    }
+
+    /**
+     * Returns true once all the records have been read
+     */
+    bool eof() const
+    {
+      return unpacker_.remaining() == 0;
+    }
+
+    /**
+     * Unpack the next record into v.
+     * @return false if there are no records left.
+     */
+    template<typename T>
+    bool next(T& v) MSGPACK_THROW__(unpack_exception)
+    {
+      if (eof())
+        return false;
+
+      unpacker_.unpack(v);
+      return true;
+    }
+
+    /**
+     * Unpack the next record into a new Object, which should
+     * be deleted by the caller.
+     * @return false if there are no records left.
+     */
+    bool next(Object*& obj) MSGPACK_THROW__(unpack_exception)
+    {
+      if (eof())
+        return false;
+
+      obj = unpacker_.unpack();
+      return true;
+    }
+
+    /**
+     * Unpack the next record into a Value allocated in the given Arena.
+     * @return false if there are no records left.
+     */
+    bool next(Value& v, Arena& arena) MSGPACK_THROW__(unpack_exception)
+    {
+      if (eof())
+        return false;
+
+      unpacker_.unpack(v, arena);
+      return true;
+    }
+
+    /**
+     * Skip the next record without unpacking it.
+     * @return false if there are no records left.
+     */
+    bool skip() MSGPACK_THROW__(unpack_exception)
+    {
+      if (eof())
+        return false;
+
+      unpacker_.skip();
+      return true;
+    }
+
+    /**
+     * Unpacker positioned on the next record
+     */
+    Unpacker& unpacker()
+    {
+      return unpacker_;
+    }
+
+    //! Pointer to the mapped data
+    const char* data() const
+    {
+      return data_;
+    }
+
+    //! Size of the mapped data in bytes
+    std::size_t size() const
+    {
+      return size_;
+    }
+
+  private:
+
+    MappedReader(const MappedReader&);
+    MappedReader& operator=(const MappedReader&);
+
+    const char* data_;   //!< The file contents
+    std::size_t size_;   //!< Size of the file
+    Unpacker unpacker_;  //!< Unpacker of the records
+
+}; // MappedReader
+
+} // namespace MSGPACK_NAMESPACE__
+
+#endif // _MSGPACK_LITE_MMAP_HPP_
@@ -0,0 +1,533 @@
+/**
+ * @file msgpack-lite-parallel.hpp
+ * @author  Arturo Blas Jiménez <arturoblas@gmail.com>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * \GPLv3
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * \Apache 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on
+ * an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @section DESCRIPTION
+ *
+ *  This header file provides multi-threaded processing of MessagePack
+ *  data: indexing and decoding of files of concatenated records
+ *  across several threads, encoding of large ranges across several
+ *  threads, and per thread caches of packers and arenas. It requires
+ *  C++11.
+ *
+ */
+
+#ifndef _MSGPACK_LITE_PARALLEL_HPP_
+#define _MSGPACK_LITE_PARALLEL_HPP_
+
+#include "msgpack-lite.hpp"
+
+#if __cplusplus < 201103L
+#error "msgpack-lite-parallel.hpp requires C++11"
+#endif
+
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace MSGPACK_NAMESPACE__
+{
+
+namespace detail
+{
+
+/**
+ * Call f(begin, end) for consecutive blocks of up to grain elements
+ * of [0, count), spread over the given number of threads, the calling
+ * one included. Zero threads stands for one per core. The first
+ * exception thrown by f is rethrown once all the threads are done.
+ */
+template<typename F>
+void parallel_for(std::size_t count, std::size_t grain, unsigned threads, F& f)
+{
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+  if (grain == 0)
+    grain = 1;
+
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error;
+  std::mutex mutex;
+
+  auto work = [&]()
+  {
+    for (;;)
+    {
+      std::size_t begin = next.fetch_add(grain);
+      if (begin >= count)
+        return;
+
+      std::size_t end = (count - begin < grain) ? count : begin + grain;
+      try
+      {
+        f(begin, end);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+        next = count;
+        return;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads && i * grain < count; i++)
+    workers.push_back(std::thread(work));
+
+  work();
+  for (std::size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+/**
+ * Instances of T kept by the running thread for later reuse
+ */
+template<typename T>
+struct thread_cache
+{
+  enum { MAX_FREE = 4 }; //!< Instances kept at most
+
+  thread_cache()
+  {
+    free.reserve(MAX_FREE);
+  }
+
+  ~thread_cache()
+  {
+    for (std::size_t i = 0; i < free.size(); i++)
+      delete free[i];
+  }
+
+  //! The cache of the calling thread
+  static thread_cache& local()
+  {
+    static thread_local thread_cache cache;
+    return cache;
+  }
+
+  std::vector<T*> free; //!< Instances ready to be reused
+};
+
+//! Make a BufferPacker ready for reuse, dropping its buffer if too big
+template<typename Buffer>
+void recycle(BufferPacker<Buffer>& packer, std::size_t highWaterMark)
+{
+  if (packer.capacity() > highWaterMark)
+  {
+    Buffer buffer;
+    packer.release(buffer);
+  }
+  packer.clear();
+}
+
+//! Make an Arena ready for reuse, dropping its chunks if too big
+inline void recycle(Arena& arena, std::size_t highWaterMark)
+{
+  if (arena.capacity() > highWaterMark)
+    arena.release();
+  else
+    arena.reset();
+}
+
+} // namespace detail
+
+/**
+ * ThreadLocal class. Hands out an instance of T, either a BufferPacker
+ * or an Arena, cached by the calling thread, so that the memory they
+ * grow to is reused by the following requests the thread serves with
+ * no allocations nor locking. On destruction, the instance is cleared
+ * and returned to the cache, its memory being released if it went
+ * over the high water mark.
+ * Instances must be destroyed by the thread which created them.
+ */
+template<typename T>
+class ThreadLocal
+{
+  public:
+
+    /**
+     * Constructor
+     * @param highWaterMark Memory in bytes above which an
+     * instance releases it when returned to the cache
+     */
+    explicit ThreadLocal(std::size_t highWaterMark = 1 << 20) :
+      highWaterMark_(highWaterMark), item_(0)
+    {
+      std::vector<T*>& free = detail::thread_cache<T>::local().free;
+      if (free.empty())
+      {
+        item_ = new T();
+      }
+      else
+      {
+        item_ = free.back();
+        free.pop_back();
+      }
+    }
+
+    /**
+     * Destructor. Returns the instance to the cache.
+     */
+    ~ThreadLocal()
+    {
+      std::vector<T*>& free = detail::thread_cache<T>::local().free;
+      if (free.size() < detail::thread_cache<T>::MAX_FREE)
+      {
+        detail::recycle(*item_, highWaterMark_);
+        free.push_back(item_);
+      }
+      else
+      {
+        delete item_;
+      }
+    }
+
+    T& operator*() const
+    {
+      return *item_;
+    }
+
+    T* operator->() const
+    {
+      return item_;
+    }
+
+  private:
+
+    ThreadLocal(const ThreadLocal&);
+    ThreadLocal& operator=(const ThreadLocal&);
+
+    std::size_t highWaterMark_; //!< Memory kept at most by the instance
+    T* item_;                   //!< The instance
+
+}; // ThreadLocal
+
+//! BufferPacker cached by the calling thread
+typedef ThreadLocal<BufferPacker<> > LocalPacker;
+
+//! Arena cached by the calling thread
+typedef ThreadLocal<Arena> LocalArena;
+
+/**
+ * RecordIndex class. Holds the offsets of the records of a memory
+ * region of concatenated MessagePack records, e.g. the one of a
+ * {@see MappedReader}, found with {@see Unpacker::skip()}. It can be
+ * saved into a sidecar file so that it is only built once. The file
+ * holds a checksum of the indexed data, so that it is not used for
+ * data rewritten since.
+ */
+class RecordIndex
+{
+  public:
+
+    /**
+     * Constructor. Builds an empty index.
+     */
+    RecordIndex() : size_(0), checksum_(0) {}
+
+    /**
+     * Index the records of the given memory region
+     * @param data Pointer to the records
+     * @param length Length of the records in bytes
+     */
+    void build(const char* data, std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      offsets_.clear();
+      size_ = length;
+      checksum_ = checksum(data, length);
+
+      Unpacker unpacker(data, length);
+      while (unpacker.remaining() > 0)
+      {
+        offsets_.push_back(length - unpacker.remaining());
+        unpacker.skip();
+      }
+    }
+
+    /**
+     * Load the index from the given sidecar file.
+     * @param path Path of the file
+     * @param data Pointer to the indexed data
+     * @param length Length of the indexed data, the file being
+     * ignored if it was built for a different one
+     * @return false if the file is missing or does not match
+     */
+    bool load(const char* path, const char* data, std::size_t length)
+    {
+      std::ifstream in(path, std::ios::binary);
+      char header[MAGIC_SIZE];
+      uint64_t size = 0;
+      uint64_t sum = 0;
+      uint64_t count = 0;
+      in.read(header, sizeof(header));
+      in.read((char*) &size, sizeof(size));
+      in.read((char*) &sum, sizeof(sum));
+      in.read((char*) &count, sizeof(count));
+      if (!in || std::memcmp(header, magic(), MAGIC_SIZE) != 0 ||
+          size != length || count > length)
+        return false;
+
+      std::vector<uint64_t> offsets(count);
+      if (count > 0)
+        in.read((char*) &offsets[0], count * sizeof(uint64_t));
+      if (!in)
+        return false;
+
+      for (std::size_t i = 0; i < count; i++)
+      {
+        if (offsets[i] >= length || (i > 0 && offsets[i] <= offsets[i - 1]))
+          return false;
+      }
+
+      // Same length is not enough, the data might have been rewritten
+      if (sum != checksum(data, length))
+        return false;
+
+      offsets_.assign(offsets.begin(), offsets.end());
+      size_ = length;
+      checksum_ = sum;
+      return true;
+    }
+
+    /**
+     * Save the index into the given sidecar file, a std::ios_base::failure
+     * being thrown should it fail.
+     */
+    void save(const char* path) const
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      uint64_t size = size_;
+      uint64_t sum = checksum_;
+      uint64_t count = offsets_.size();
+      out.write(magic(), MAGIC_SIZE);
+      out.write((const char*) &size, sizeof(size));
+      out.write((const char*) &sum, sizeof(sum));
+      out.write((const char*) &count, sizeof(count));
+      for (std::size_t i = 0; i < offsets_.size(); i++)
+      {
+        uint64_t offset = offsets_[i];
+        out.write((const char*) &offset, sizeof(offset));
+      }
+      if (!out)
+        throw std::ios_base::failure("Unable to write the record index");
+    }
+
+    /**
+     * Load the index from the given sidecar file, or build it and
+     * save it there if the file is missing or does not match the data.
+     */
+    void open(const char* path, const char* data, std::size_t length)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      if (!load(path, data, length))
+      {
+        build(data, length);
+        save(path);
+      }
+    }
+
+    //! Number of records
+    std::size_t size() const
+    {
+      return offsets_.size();
+    }
+
+    //! Offset of the given record
+    std::size_t offset(std::size_t i) const
+    {
+      return offsets_[i];
+    }
+
+    //! Length of the given record in bytes
+    std::size_t length(std::size_t i) const
+    {
+      return ((i + 1 < offsets_.size()) ? offsets_[i + 1] : size_) - offsets_[i];
+    }
+
+  private:
+
+    enum { MAGIC_SIZE = 8 };
+
+    //! Identifies the sidecar files, whose offsets are in host byte order
+    static const char* magic()
+    {
+      return "MPLIDX02";
+    }
+
+    //! Checksum of the indexed data, FNV-1a over words of 8 bytes
+    static uint64_t checksum(const char* data, std::size_t length)
+    {
+      const uint64_t prime = 1099511628211ull;
+      uint64_t hash = 14695981039346656037ull;
+      std::size_t i = 0;
+      for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+      {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+      }
+      for (; i < length; i++)
+        hash = (hash ^ (uint8_t) data[i]) * prime;
+      return hash;
+    }
+
+    std::vector<std::size_t> offsets_;  //!< Offsets of the records
+    std::size_t size_;                  //!< Length of the indexed data
+    uint64_t checksum_;                 //!< Checksum of the indexed data
+
+}; // RecordIndex
+
+/**
+ * Call f(unpacker, i) for every record i of the given index, spreading
+ * them over the given number of threads. Each call gets its own zero
+ * copy Unpacker over the record, so f must be safe to run concurrently.
+ * The first exception thrown is rethrown once all the threads are done.
+ * @param data Pointer to the indexed records
+ * @param index Index of the records
+ * @param f Function or functor taking an Unpacker& and a std::size_t
+ * @param threads Number of threads to use, zero for one per core
+ */
+template<typename F>
+void forEachRecord(const char* data, const RecordIndex& index, F f, unsigned threads = 0)
+{
+  auto block = [&](std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++)
+    {
+      Unpacker unpacker(data + index.offset(i), index.length(i), true);
+      f(unpacker, i);
+    }
+  };
+  detail::parallel_for(index.size(), 64, threads, block);
+}
+
+namespace detail
+{
+
+/**
+ * Encode the elements of a random access range in chunks spread over
+ * the given number of threads, each one into a SegmentPacker like the
+ * given one, and return the packers in order. A zero grain is set to
+ * the number of elements chosen for each chunk.
+ */
+template<typename RandomIt>
+std::vector<std::unique_ptr<SegmentPacker> > pack_chunks(RandomIt first, RandomIt last,
+    std::size_t segmentSize, std::size_t referenceLength, unsigned threads, std::size_t& grain)
+{
+  std::size_t count = last - first;
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+  if (grain == 0)
+    grain = std::max<std::size_t>(1, count / (8 * threads));
+
+  std::vector<std::unique_ptr<SegmentPacker> > chunks((count + grain - 1) / grain);
+  auto block = [&](std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++)
+    {
+      chunks[i].reset(new SegmentPacker(segmentSize, referenceLength));
+      std::size_t stop = std::min(count, (i + 1) * grain);
+      for (std::size_t j = i * grain; j < stop; j++)
+        chunks[i]->pack(first[j]);
+    }
+  };
+  parallel_for(chunks.size(), 1, threads, block);
+  return chunks;
+}
+
+} // namespace detail
+
+/**
+ * Pack the elements of a random access range as an array, encoding
+ * them in chunks on several threads. The segments of the chunks are
+ * then taken over by the packer, in order and without copies, see
+ * {@see SegmentPacker::append()}. The elements must be safe to pack
+ * concurrently. The first exception thrown is rethrown once all the
+ * threads are done, leaving the packer with the array header only.
+ * @param packer Packer the array is packed into
+ * @param first Iterator to the initial position of the range
+ * @param last Iterator to the final position of the range
+ * @param threads Number of threads to use, zero for one per core
+ * @param grain Number of elements of each chunk, zero to choose it
+ */
+template<typename RandomIt>
+void packParallel(SegmentPacker& packer, RandomIt first, RandomIt last,
+    unsigned threads = 0, std::size_t grain = 0)
+{
+  packer.packArrayHeader(last - first);
+  std::vector<std::unique_ptr<SegmentPacker> > chunks = detail::pack_chunks(first, last,
+      packer.segmentSize(), packer.referenceLength(), threads, grain);
+
+  for (std::size_t i = 0; i < chunks.size(); i++)
+    packer.append(*chunks[i]);
+}
+
+/**
+ * Equivalent to packParallel(SegmentPacker&, RandomIt, RandomIt, unsigned, std::size_t)
+ * for any other Packer, such as a BufferPacker giving a contiguous
+ * output. The data of the chunks is copied into the packer.
+ */
+template<typename RandomIt>
+void packParallel(Packer& packer, RandomIt first, RandomIt last,
+    unsigned threads = 0, std::size_t grain = 0)
+{
+  std::size_t count = last - first;
+  packer.packArrayHeader(count);
+  std::vector<std::unique_ptr<SegmentPacker> > chunks = detail::pack_chunks(first, last,
+      64 * 1024, 1024, threads, grain);
+
+  for (std::size_t i = 0; i < chunks.size(); i++)
+  {
+    // The elements of the chunk are counted along with its first slice
+    std::size_t elements = std::min(count, (i + 1) * grain) - i * grain;
+    const std::vector<RawRef>& slices = chunks[i]->slices();
+    for (std::size_t j = 0; j < slices.size(); j++)
+      packer.splice(slices[j].data, slices[j].size, j == 0 ? elements : 0);
+  }
+}
+
+} // namespace MSGPACK_NAMESPACE__
+
+#endif // _MSGPACK_LITE_PARALLEL_HPP_
@@ -43,8 +43,21 @@
 #define _MSGPACK_LITE_HPP_
 
 #include <stdint.h>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MSGPACK_SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define MSGPACK_SSSE3__
+#include <tmmintrin.h>
+#endif
 
 #include <vector>
+#include <algorithm>
 #include <list>
 #include <deque>
 #include <queue>
@@ -56,6 +69,10 @@
 #include <typeinfo>
 #include <locale>
 #include <iostream>
+#include <new>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #ifdef GLOBAL_NAMESPACE__
 #define NAMESPACE_HEADER__ namespace GLOBAL_NAMESPACE__
@@ -66,6 +83,15 @@
 #define MSGPACK_NAMESPACE__ msgpack_lite
 #endif
 
+// Dynamic exception specifications are no longer valid since C++17
+#if __cplusplus >= 201703L
+#define MSGPACK_THROW__(__EXCEPTION__)
+#define MSGPACK_THROW2__(__EXCEPTION1__, __EXCEPTION2__)
+#else
+#define MSGPACK_THROW__(__EXCEPTION__) throw(__EXCEPTION__)
+#define MSGPACK_THROW2__(__EXCEPTION1__, __EXCEPTION2__) throw(__EXCEPTION1__, __EXCEPTION2__)
+#endif
+
 namespace MSGPACK_NAMESPACE__
 {
 namespace bm
@@ -140,6 +166,232 @@ static const uint32_t MAX_32BIT = 0xffffffff;
 // Forward declarations
 class Packer;
 class Unpacker;
+class Parcelable;
+
+/**
+ * Exception likely to be thrown during the
+ * data serialization.
+ */
+typedef std::ios_base::failure pack_exception;
+
+/**
+ * Non-owning reference to a raw memory area, such as
+ * the payload of a RAW element in an Unpacker buffer.
+ */
+struct RawRef
+{
+  RawRef() : data(0), size(0) {}
+  RawRef(const char* d, std::size_t s) : data(d), size(s) {}
+
+  const char* data;  //!< Pointer to the memory area
+  std::size_t size;  //!< Length of the memory area in bytes
+};
+
+/**
+ * FIXRAW element whose bytes and header are known at compile time,
+ * such as the map keys of a schema. Built with the MSGPACK_FIXRAW
+ * macro from a string literal, without any code run at runtime.
+ */
+struct FixRaw
+{
+  uint8_t header;     //!< The FIXRAW header byte
+  const char* data;   //!< The bytes of the string literal
+  std::size_t length; //!< Length of the string in bytes
+};
+
+/**
+ * Build a {@see FixRaw} from a string literal of up to 31 characters,
+ * longer ones failing to compile. Usable in constant expressions.
+ */
+#define MSGPACK_FIXRAW(__LITERAL__) \
+  { (uint8_t) (0xa0 | (sizeof(__LITERAL__) - 1)), __LITERAL__, \
+    sizeof(__LITERAL__) - sizeof(char[sizeof(__LITERAL__) <= 32 ? 1 : -1]) }
+
+class Fragment;
+
+namespace detail
+{
+
+/**
+ * Number of consecutive elements in the given memory region.
+ * Defined after the {@see Unpacker} class.
+ */
+inline std::size_t count_elements(const char* data, std::size_t length);
+
+//! Unsigned integer type of the given size
+template<std::size_t N> struct uint_of {};
+template<> struct uint_of<1> { typedef uint8_t type; };
+template<> struct uint_of<2> { typedef uint16_t type; };
+template<> struct uint_of<4> { typedef uint32_t type; };
+template<> struct uint_of<8> { typedef uint64_t type; };
+
+//! Reverse the order of the bytes of an unsigned integer
+inline uint8_t byte_swap(uint8_t v)
+{
+  return v;
+}
+
+#if defined(__GNUC__)
+inline uint16_t byte_swap(uint16_t v) { return (uint16_t) ((v >> 8) | (v << 8)); }
+inline uint32_t byte_swap(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t byte_swap(uint64_t v) { return __builtin_bswap64(v); }
+#elif defined(_MSC_VER)
+inline uint16_t byte_swap(uint16_t v) { return _byteswap_ushort(v); }
+inline uint32_t byte_swap(uint32_t v) { return _byteswap_ulong(v); }
+inline uint64_t byte_swap(uint64_t v) { return _byteswap_uint64(v); }
+#else
+inline uint16_t byte_swap(uint16_t v)
+{
+  return (uint16_t) ((v >> 8) | (v << 8));
+}
+inline uint32_t byte_swap(uint32_t v)
+{
+  return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+inline uint64_t byte_swap(uint64_t v)
+{
+  return ((uint64_t) byte_swap((uint32_t) v) << 32) | byte_swap((uint32_t) (v >> 32));
+}
+#endif
+
+//! Convert between host and network (big endian) byte order
+template<typename U> inline
+U to_network(U v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return v;
+#else
+  return byte_swap(v);
+#endif
+}
+
+/**
+ * Store a value into a possibly unaligned memory
+ * position, in network byte order
+ */
+template<typename T> inline
+void store_network(char* p, T v)
+{
+  typename uint_of<sizeof(T)>::type u;
+  std::memcpy(&u, &v, sizeof(T));
+  u = to_network(u);
+  std::memcpy(p, &u, sizeof(T));
+}
+
+/**
+ * Load a value stored in network byte order from a
+ * possibly unaligned memory position
+ */
+template<typename T> inline
+T load_network(const char* p)
+{
+  typename uint_of<sizeof(T)>::type u;
+  std::memcpy(&u, p, sizeof(T));
+  u = to_network(u);
+  T v;
+  std::memcpy(&v, &u, sizeof(T));
+  return v;
+}
+
+#ifdef MSGPACK_SSSE3__
+/**
+ * Encode 4 floats as MP_FLOAT elements, 20 bytes in all. Each shuffle
+ * reverses the bytes of the values and spreads them apart to make room
+ * for the headers; the two 16 byte stores overlap.
+ */
+inline void encode_floats(char* p, const float* data)
+{
+  const char H = (char) bm::MP_FLOAT;
+  __m128i in = _mm_loadu_si128((const __m128i*) data);
+  __m128i lo = _mm_shuffle_epi8(in, _mm_setr_epi8(-1, 3, 2, 1, 0, -1, 7, 6, 5, 4, -1, 11, 10, 9, 8, -1));
+  __m128i hi = _mm_shuffle_epi8(in, _mm_setr_epi8(0, -1, 7, 6, 5, 4, -1, 11, 10, 9, 8, -1, 15, 14, 13, 12));
+  _mm_storeu_si128((__m128i*) p, _mm_or_si128(lo, _mm_setr_epi8(H, 0, 0, 0, 0, H, 0, 0, 0, 0, H, 0, 0, 0, 0, H)));
+  _mm_storeu_si128((__m128i*) (p + 4), _mm_or_si128(hi, _mm_setr_epi8(0, H, 0, 0, 0, 0, H, 0, 0, 0, 0, H, 0, 0, 0, 0)));
+}
+
+//! Encode 2 doubles as MP_DOUBLE elements, 18 bytes in all
+inline void encode_doubles(char* p, const double* data)
+{
+  const char H = (char) bm::MP_DOUBLE;
+  __m128i in = _mm_loadu_si128((const __m128i*) data);
+  __m128i lo = _mm_shuffle_epi8(in, _mm_setr_epi8(-1, 7, 6, 5, 4, 3, 2, 1, 0, -1, 15, 14, 13, 12, 11, 10));
+  __m128i hi = _mm_shuffle_epi8(in, _mm_setr_epi8(6, 5, 4, 3, 2, 1, 0, -1, 15, 14, 13, 12, 11, 10, 9, 8));
+  _mm_storeu_si128((__m128i*) p, _mm_or_si128(lo, _mm_setr_epi8(H, 0, 0, 0, 0, 0, 0, 0, 0, H, 0, 0, 0, 0, 0, 0)));
+  _mm_storeu_si128((__m128i*) (p + 2), _mm_or_si128(hi, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, H, 0, 0, 0, 0, 0, 0, 0, 0)));
+}
+
+/**
+ * Decode 4 MP_FLOAT elements, 20 bytes in all, whose headers were
+ * checked. The payloads are gathered from two overlapping loads.
+ */
+inline void decode_floats(float* out, const char* p)
+{
+  __m128i lo = _mm_loadu_si128((const __m128i*) p);
+  __m128i hi = _mm_loadu_si128((const __m128i*) (p + 4));
+  lo = _mm_shuffle_epi8(lo, _mm_setr_epi8(4, 3, 2, 1, 9, 8, 7, 6, 14, 13, 12, 11, -1, -1, -1, -1));
+  hi = _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, 14, 13, 12));
+  _mm_storeu_si128((__m128i*) out, _mm_or_si128(lo, hi));
+}
+#endif
+
+//! Utility struct that allows to dispatch on integer constants
+template<int N>
+struct int_tag {};
+
+/**
+ * This defines the arithmetic types whose contiguous
+ * arrays can be packed in bulk.
+ */
+template<typename T>
+struct is_bulk { enum { value = 0 }; };
+
+#define BULK_TYPE(__TYPE__) \
+    template<> \
+    struct is_bulk<__TYPE__> \
+    { \
+    enum { value = 1 }; \
+    };
+
+BULK_TYPE(char)
+BULK_TYPE(signed char)
+BULK_TYPE(unsigned char)
+BULK_TYPE(short)
+BULK_TYPE(unsigned short)
+BULK_TYPE(int)
+BULK_TYPE(unsigned int)
+BULK_TYPE(long)
+BULK_TYPE(unsigned long)
+#if __cplusplus >= 201103L
+BULK_TYPE(long long)
+BULK_TYPE(unsigned long long)
+#endif
+BULK_TYPE(float)
+BULK_TYPE(double)
+
+/**
+ * This defines how the generic pack and unpack methods
+ * handle a type T: as an integral value, using the
+ * members generated by {@see MSGPACK_FIELDS}, or as a
+ * {@see Parcelable}.
+ */
+enum { NO_USER_TYPE, FIELDS_TYPE, PARCELABLE_TYPE };
+
+template<typename T>
+struct user_type
+{
+  template<typename U>
+  static char has_fields(typename U::msgpack_fields_tag*);
+  template<typename U>
+  static long has_fields(...);
+
+  static char is_parcelable(const Parcelable*);
+  static long is_parcelable(...);
+
+  enum { value = sizeof(has_fields<T>(0)) == 1 ? FIELDS_TYPE :
+         sizeof(is_parcelable((const T*) 0)) == 1 ? PARCELABLE_TYPE : NO_USER_TYPE };
+};
+
+} // namespace detail
 
 /**
  * This interface allows to extend any type to
@@ -169,6 +421,10 @@ class Parcelable
 /**
  * Packer class. Provides the functionality to serialize data
  * into a stream using the MessagePack binary data.
+ * Data is copied into the current output buffer, and only when
+ * it runs out of space the overflow() method is called, which
+ * by default forwards the data to the output stream.
+ * {@see BufferPacker} provides buffer based backends.
  */
 class Packer
 {
@@ -178,7 +434,22 @@ class Packer
      * Constructor
      * @param out Packer output stream where the binary data will be put
      */
-    explicit Packer(std::ostream& out) : out_(out) {}
+    explicit Packer(std::ostream& out) :
+      out_(&out), begin_(0), cur_(0), end_(0), referenceLength_(std::size_t(-1)),
+      elements_(0), pending_(0) {}
+
+    /**
+     * Destructor
+     */
+    virtual ~Packer() {}
+
+    /**
+     * Compute the exact number of bytes packing the given value takes,
+     * without writing anything. See {@see SizePacker}.
+     * @param value Reference to the value to be measured
+     */
+    template<typename T>
+    static std::size_t packedSize(const T& value);
 
     /**
      * This method allows to pack an object of any type
@@ -194,12 +465,14 @@ class Packer
     /**
      * Packs any data type that can be casted into an int64_t
      * for which there's not any overloaded pack method.
+     * Types declaring their fields with {@see MSGPACK_FIELDS} and
+     * types implementing the Parcelable interface are packed as such.
      * @param item Data element to be packed.
      */
     template<typename T> inline
-    Packer& pack(T item)
+    Packer& pack(const T& item)
     {
-      return pack((int64_t) item);
+      return packItem(item, detail::int_tag<detail::user_type<T>::value>());
     }
 
     /**
@@ -211,7 +484,10 @@ class Packer
     template<typename T> inline
     Packer& pack(const T* item)
     {
-      return (item == 0) ? write(bm::MP_NULL) : pack(*item);
+      if (item != 0)
+        return pack(*item);
+      element(0);
+      return write(bm::MP_NULL);
     }
 
 
@@ -226,7 +502,10 @@ class Packer
      */
     Packer& pack(const char* item)
     {
-      return (item == 0) ? write(bm::MP_NULL) : pack(item, strlen(item));
+      if (item != 0)
+        return pack(item, strlen(item));
+      element(0);
+      return write(bm::MP_NULL);
     }
 
     /**
@@ -238,8 +517,10 @@ class Packer
      */
     Packer& pack(const wchar_t* item)
     {
-      return (item == 0) ? write(bm::MP_NULL) :
-          pack((char*)item, wcslen(item)*sizeof(wchar_t));
+      if (item != 0)
+        return pack((char*)item, wcslen(item)*sizeof(wchar_t));
+      element(0);
+      return write(bm::MP_NULL);
     }
 
     /**
@@ -248,6 +529,7 @@ class Packer
      */
     Packer& pack(bool item)
     {
+      element(0);
       return (item ? write(bm::MP_TRUE) : write(bm::MP_FALSE));
     }
 
@@ -257,53 +539,9 @@ class Packer
      */
     Packer& pack(const int64_t& value)
     {
-      if (value >= 0)
-      {
-        if (value <= bm::MAX_7BIT)
-        {
-          write<int8_t>((int8_t(value) | bm::MP_FIXNUM));
-        }
-        else if (value <= bm::MAX_8BIT)
-        {
-          write(bm::MP_UINT8).write<int8_t>(value);
-        }
-        else if (value <= bm::MAX_16BIT)
-        {
-          write(bm::MP_UINT16).write<uint16_t>(value);
-        }
-        else if (value <= bm::MAX_32BIT)
-        {
-          write(bm::MP_UINT32).write<uint32_t>(value);
-        }
-        else
-        {
-          write(bm::MP_UINT64).write<uint64_t>(value);
-        }
-      }
-      else
-      {
-        if (value >= -(bm::MAX_5BIT + 1))
-        {
-          write<int8_t>(int8_t(value) | bm::MP_NEGATIVE_FIXNUM);
-        }
-        else if (value >= -(bm::MAX_7BIT + 1))
-        {
-          write(bm::MP_INT8).write<int8_t>(value);
-        }
-        else if (value >= -(bm::MAX_15BIT + 1))
-        {
-          write(bm::MP_INT16).write<int16_t>(value);
-        }
-        else if (value >= -(int64_t(bm::MAX_31BIT) + 1))
-        {
-          write(bm::MP_INT32).write<int32_t>(value);
-        }
-        else
-        {
-          write(bm::MP_INT64).write<int64_t>(value);
-        }
-      }
-      return *this;
+      element(0);
+      char buf[9];
+      return write(buf, encode(buf, value) - buf);
     }
 
     /**
@@ -312,7 +550,9 @@ class Packer
      */
     Packer& pack(float item)
     {
-      return write(bm::MP_FLOAT).write(item);
+      element(0);
+      char buf[5];
+      return write(buf, encode(buf, item) - buf);
     }
 
     /**
@@ -321,17 +561,82 @@ class Packer
      */
     Packer& pack(double item)
     {
-      return write(bm::MP_DOUBLE).write(item);
+      element(0);
+      char buf[9];
+      return write(buf, encode(buf, item) - buf);
     }
 
     /**
-     * Pack a generic C++ string object.
+     * Pack a generic C++ string object. Its whole contents are packed,
+     * embedded null characters included.
      * @param item Reference to the string to be packed
      */
     template<class T>
     Packer& pack(const std::basic_string<T>& value)
     {
-        return pack(value.c_str());
+      return pack((const char*) value.data(), value.size() * sizeof(T));
+    }
+
+#if __cplusplus >= 201703L
+    /**
+     * Pack the contents of a string view.
+     * @param item The view of the string to be packed
+     */
+    template<class T>
+    Packer& pack(std::basic_string_view<T> value)
+    {
+      return pack((const char*) value.data(), value.size() * sizeof(T));
+    }
+#endif
+
+    /**
+     * Pack a raw memory area referenced by a RawRef.
+     * @param raw Reference to the memory area
+     */
+    Packer& pack(const RawRef& raw)
+    {
+      return pack(raw.data, raw.size);
+    }
+
+    /**
+     * Pack a RAW element built at compile time with MSGPACK_FIXRAW.
+     * @param raw The element to be packed
+     */
+    Packer& pack(const FixRaw& raw)
+    {
+      element(0);
+      if (std::size_t(end_ - cur_) > raw.length)
+      {
+        *cur_ = (char) raw.header;
+        std::memcpy(cur_ + 1, raw.data, raw.length);
+        cur_ += raw.length + 1;
+        return *this;
+      }
+
+      write((const char*) &raw.header, 1);
+      return write(raw.data, raw.length);
+    }
+
+    /**
+     * Splice a pre-encoded element into the stream, copying its
+     * bytes as they are. It counts as a single element of the
+     * enclosing array or map.
+     * @param fragment The element to be packed
+     */
+    Packer& pack(const Fragment& fragment);
+
+    /**
+     * Copy already encoded elements into the stream as they are,
+     * e.g. those packed by another Packer. They must be well formed,
+     * and be counted by the header of the enclosing container.
+     * @param data Pointer to the encoded elements
+     * @param length Length of the encoded elements in bytes
+     * @param count Number of top level elements in the data
+     */
+    Packer& splice(const char* data, std::size_t length, std::size_t count)
+    {
+      elements(count);
+      return write(data, length);
     }
 
     /**
@@ -343,20 +648,45 @@ class Packer
      */
     Packer& pack(const char* data, std::size_t length)
     {
+      element(0);
+      char header[5];
+      char* p = header;
       if (length <= bm::MAX_5BIT)
       {
-        write((int8_t) (((int8_t) length) | bm::MP_FIXRAW));
+        p = put<int8_t>(p, ((int8_t) length) | bm::MP_FIXRAW);
       }
       else if (length <= bm::MAX_16BIT)
       {
-        write(bm::MP_RAW16).write<int16_t>(length);
+        p = put<uint16_t>(put(p, bm::MP_RAW16), length);
+      }
+      else if (length <= bm::MAX_32BIT)
+      {
+        p = put<uint32_t>(put(p, bm::MP_RAW32), length);
       }
       else
       {
-        write(bm::MP_RAW32).write<int32_t>(length);
+        throw pack_exception("Raw data too long");
       }
-      out_.write(data, length);
-      return *this;
+      std::size_t headerSize = p - header;
+
+      if (length >= referenceLength_)
+      {
+        write(header, headerSize);
+        reference(data, length);
+        return *this;
+      }
+
+      // Header and payload in one go when they fit in the buffer
+      if (std::size_t(end_ - cur_) >= headerSize + length)
+      {
+        std::memcpy(cur_, header, headerSize);
+        std::memcpy(cur_ + headerSize, data, length);
+        cur_ += headerSize + length;
+        return *this;
+      }
+
+      write(header, headerSize);
+      return write(data, length);
     }
 
     /**
@@ -390,13 +720,104 @@ class Packer
     }
 
     /**
-     * Pack a std::vector
+     * Pack the header of an array of the given length. The
+     * length elements must be packed right after it.
+     * @param length Number of elements in the array.
+     */
+    Packer& packArrayHeader(std::size_t length)
+    {
+      element(length);
+      if (length <= bm::MAX_4BIT)
+      {
+        return write<int8_t>(((int8_t) length) | bm::MP_FIXARRAY);
+      }
+
+      char buf[5];
+      if (length <= bm::MAX_16BIT)
+      {
+        return write(buf, put<int16_t>(put(buf, bm::MP_ARRAY16), length) - buf);
+      }
+      return write(buf, put<int32_t>(put(buf, bm::MP_ARRAY32), length) - buf);
+    }
+
+    /**
+     * Equivalent to packArrayHeader(std::size_t) for a length
+     * known at compile time, so that fix arrays headers are
+     * written as a constant.
+     */
+    template<std::size_t N> inline
+    Packer& packArrayHeader()
+    {
+      if (N <= bm::MAX_4BIT)
+      {
+        element(N);
+        return write<uint8_t>(uint8_t(bm::MP_FIXARRAY | N));
+      }
+      return packArrayHeader(N);
+    }
+
+    /**
+     * Pack the header of a map of the given length. The length
+     * pairs of key and value must be packed right after it.
+     * @param length Number of entries in the map.
+     */
+    Packer& packMapHeader(std::size_t length)
+    {
+      element(2 * (uint64_t) length);
+      if (length <= bm::MAX_4BIT)
+      {
+        return write<int8_t>(((int8_t) length) | bm::MP_FIXMAP);
+      }
+
+      char buf[5];
+      if (length <= bm::MAX_16BIT)
+      {
+        return write(buf, put<int16_t>(put(buf, bm::MP_MAP16), length) - buf);
+      }
+      return write(buf, put<int32_t>(put(buf, bm::MP_MAP32), length) - buf);
+    }
+
+    /**
+     * Pack a contiguous array of arithmetic values. The array header
+     * is written once and the elements are encoded in blocks, straight
+     * into the output buffer when there's enough room for them.
+     * @param data Pointer to the first element of the array.
+     * @param length Number of elements in the array.
+     */
+    template<typename T>
+    Packer& packArray(const T* data, std::size_t length)
+    {
+      T type = T();
+      initContainer(length, type);
+      elements(length);
+
+      char buf[BULK_BLOCK * 9];
+      while (length > 0)
+      {
+        std::size_t n = length < BULK_BLOCK ? length : std::size_t(BULK_BLOCK);
+        if (std::size_t(end_ - cur_) >= n * 9)
+        {
+          cur_ = encodeBlock(cur_, data, n);
+        }
+        else
+        {
+          write(buf, encodeBlock(buf, data, n) - buf);
+        }
+        data += n;
+        length -= n;
+      }
+      return *this;
+    }
+
+    /**
+     * Pack a std::vector. Vectors of arithmetic
+     * types are packed using packArray().
      * @param item reference to the container to be packed.
      */
     template<typename T>
     Packer& pack(const std::vector<T>& item)
     {
-      return pack(item.begin(), item.end());
+      return packVector(item, detail::int_tag<detail::is_bulk<T>::value>());
     }
 
     /**
@@ -527,393 +948,1651 @@ class Packer
       return this->pack(parcel);
     }
 
-  private:
+  protected:
+
+    /**
+     * Constructor for buffer based backends, which
+     * are expected to provide the output buffer.
+     */
+    Packer() : out_(0), begin_(0), cur_(0), end_(0), referenceLength_(std::size_t(-1)),
+      elements_(0), pending_(0) {}
+
+    /**
+     * Set the output buffer
+     * @param begin Start of the buffer
+     * @param cur Position where the next byte will be written
+     * @param end End of the buffer
+     */
+    void setBuffer(char* begin, char* cur, char* end)
+    {
+      begin_ = begin;
+      cur_ = cur;
+      end_ = end;
+    }
+
+    //! Number of bytes written into the current buffer
+    std::size_t used() const
+    {
+      return cur_ - begin_;
+    }
+
+    /**
+     * Called when the data does not fit in the current buffer.
+     * Implementations must either consume the whole data or throw
+     * a {@see pack_exception}.
+     * @param data Pointer to the data to be written.
+     * @param length Length of the data in bytes.
+     */
+    virtual void overflow(const char* data, std::size_t length)
+    {
+      if (out_ == 0)
+        throw pack_exception("Packer buffer overflow");
 
-    //! Write data into the underlying stream
+      out_->write(data, length);
+    }
+
+    /**
+     * Set the minimum length of the raw payloads handed to reference()
+     * instead of being written
+     */
+    void setReferenceLength(std::size_t length)
+    {
+      referenceLength_ = length;
+    }
+
+    //! Minimum length of the raw payloads handed to reference()
+    std::size_t getReferenceLength() const
+    {
+      return referenceLength_;
+    }
+
+    /**
+     * Called for raw payloads of at least the reference length, which
+     * the backend may keep a pointer to instead of copying them.
+     * By default the data is written as any other.
+     * @param data Pointer to the payload.
+     * @param length Length of the payload in bytes.
+     */
+    virtual void reference(const char* data, std::size_t length)
+    {
+      write(data, length);
+    }
+
+    //! Write data into the underlying buffer
     template<typename T> inline
     Packer& write(T data)
     {
-      out_.write((char*) &data, sizeof(T));
-      return *this;
+      char buf[sizeof(T)];
+      detail::store_network(buf, data);
+      return write(buf, sizeof(T));
     }
 
-    //! Initialize the header for a given container
-    template<typename T> inline
-    void initContainer(std::size_t& length, T&)
+    //! Write a memory area into the underlying buffer
+    inline Packer& write(const char* data, std::size_t length)
     {
-      if (length <= bm::MAX_4BIT)
+      if (std::size_t(end_ - cur_) >= length)
       {
-        write<int8_t>(((int8_t) length) | bm::MP_FIXARRAY);
-      }
-      else if (length <= bm::MAX_16BIT)
-      {
-        write(bm::MP_ARRAY16).write<int16_t>(length);
+        std::memcpy(cur_, data, length);
+        cur_ += length;
       }
       else
       {
-        write(bm::MP_ARRAY32).write<int32_t>(length);
+        overflow(data, length);
       }
+      return *this;
     }
 
-    //! Inintialize the header for a pair
-    template<typename key, typename val> inline
-    void initContainer(std::size_t& length, std::pair<const val, key>&)
+    /**
+     * Account for the element about to be packed, whose header is
+     * followed by the given number of nested elements. Elements are
+     * either nested into the container headers packed before them,
+     * or top level ones.
+     */
+    void element(uint64_t nested)
     {
-      if (length <= bm::MAX_4BIT)
-      {
-        write<int8_t>(((int8_t) length) | bm::MP_FIXMAP);
-      }
-      else if (length <= bm::MAX_16BIT)
+      if (pending_ > 0)
+        pending_--;
+      else
+        elements_++;
+      pending_ += nested;
+    }
+
+    //! Account for the given number of elements without nested ones
+    void elements(uint64_t count)
+    {
+      uint64_t nested = count < pending_ ? count : pending_;
+      pending_ -= nested;
+      elements_ += count - nested;
+    }
+
+  private:
+
+    enum { BULK_BLOCK = 256 }; //!< Elements encoded at once by packArray()
+
+    //! Pack a std::vector element by element
+    template<typename T>
+    Packer& packVector(const std::vector<T>& item, detail::int_tag<0>)
+    {
+      return pack(item.begin(), item.end());
+    }
+
+    //! Pack a std::vector of arithmetic values in bulk
+    template<typename T>
+    Packer& packVector(const std::vector<T>& item, detail::int_tag<1>)
+    {
+      return packArray(item.empty() ? (const T*) 0 : &item[0], item.size());
+    }
+
+    //! Copy a value into the given buffer, returning the end of it
+    template<typename T> static inline
+    char* put(char* p, T data)
+    {
+      detail::store_network(p, data);
+      return p + sizeof(T);
+    }
+
+    /**
+     * Encode an integer value into the given buffer, which must have
+     * room for 9 bytes. Returns the end of the encoded data.
+     */
+    static inline char* encode(char* p, int64_t value)
+    {
+      if (value >= 0)
       {
-        write(bm::MP_MAP16).write<int16_t>(length);
+        if (value <= bm::MAX_7BIT)
+        {
+          return put<int8_t>(p, int8_t(value) | bm::MP_FIXNUM);
+        }
+        else if (value <= bm::MAX_8BIT)
+        {
+          return put<int8_t>(put(p, bm::MP_UINT8), value);
+        }
+        else if (value <= bm::MAX_16BIT)
+        {
+          return put<uint16_t>(put(p, bm::MP_UINT16), value);
+        }
+        else if (value <= bm::MAX_32BIT)
+        {
+          return put<uint32_t>(put(p, bm::MP_UINT32), value);
+        }
+        else
+        {
+          return put<uint64_t>(put(p, bm::MP_UINT64), value);
+        }
       }
       else
       {
-        write(bm::MP_MAP32).write<int32_t>(length);
+        if (value >= -(int64_t(bm::MAX_5BIT) + 1))
+        {
+          return put<int8_t>(p, int8_t(value) | bm::MP_NEGATIVE_FIXNUM);
+        }
+        else if (value >= -(int64_t(bm::MAX_7BIT) + 1))
+        {
+          return put<int8_t>(put(p, bm::MP_INT8), value);
+        }
+        else if (value >= -(int64_t(bm::MAX_15BIT) + 1))
+        {
+          return put<int16_t>(put(p, bm::MP_INT16), value);
+        }
+        else if (value >= -(int64_t(bm::MAX_31BIT) + 1))
+        {
+          return put<int32_t>(put(p, bm::MP_INT32), value);
+        }
+        else
+        {
+          return put<int64_t>(put(p, bm::MP_INT64), value);
+        }
       }
     }
 
-    std::ostream& out_; //!< The output stream where the data is packed in
+    //! Encode a single precision floating point value
+    static inline char* encode(char* p, float value)
+    {
+      return put(put(p, bm::MP_FLOAT), value);
+    }
 
-}; // Packer
+    //! Encode a double precision floating point value
+    static inline char* encode(char* p, double value)
+    {
+      return put(put(p, bm::MP_DOUBLE), value);
+    }
 
-/**
- * Type enum type defines all the possible output types
- * for the {@see #Object} instances generated by
- * the {@see #Unpacker} class
- */
-enum object_type
-{
-  NIL,      //<! nulll
-  BOOL,     //<! boolean [true, false]
-  INT8,     //<! int8 [positive, negative fixnum]
-  INT16,    //<! int16
-  INT32,    //<! int32
-  INT64,    //<! int64
-  UINT8,    //<! uint8
-  UINT16,   //<! uint16
-  UINT32,   //<! uint32
-  UINT64,   //<! uint64
-  FLOAT,    //<! float
-  DOUBLE,   //<! double
-  RAW,      //<! Raw bytes [fix raw, raw 16, raw 32]
-  ARRAY,    //<! Array [fix array, array 16, array 32]
-  MAP       //<! Map [fix map, map 16, map 32]
+    /**
+     * Encode a block of integer values. The block is classified first,
+     * so that blocks of fixnums are just copied in a tight loop.
+     */
+    template<typename T> static
+    char* encodeBlock(char* p, const T* data, std::size_t length)
+    {
+      // Every value in [-32, 127] is a fixnum, encoded as its own low byte
+      bool fixnums = true;
+      for (std::size_t i = 0; i < length; i++)
+        fixnums &= (uint64_t) (int64_t) data[i] + 32u <= 159u;
 
-}; // object_type
+      if (fixnums)
+      {
+        for (std::size_t i = 0; i < length; i++)
+          p[i] = (char) data[i];
+        return p + length;
+      }
 
-namespace detail
-{
+      for (std::size_t i = 0; i < length; i++)
+        p = encode(p, (int64_t) data[i]);
+      return p;
+    }
 
-/**
- * This defines the primary relationship
- * between an object_type and the data
- * type that is actually handled by it
- */
-template<object_type t>
-struct type_traits {
-};
+    /**
+     * Encode a block of single precision floating point values. With
+     * SSSE3 the bytes of four values at a time are swapped with a
+     * single shuffle.
+     */
+    static char* encodeBlock(char* p, const float* data, std::size_t length)
+    {
+      std::size_t i = 0;
+#ifdef MSGPACK_SSSE3__
+      for (; length - i >= 4; i += 4, p += 20)
+        detail::encode_floats(p, data + i);
+#endif
+      for (; i < length; i++)
+        p = encode(p, data[i]);
+      return p;
+    }
 
-/**
- * This defines the possible casts
- * from a given type T to an object type.
- */
-template<typename T>
-struct type_cast {
-};
+    //! Encode a block of double precision floating point values, two at a time with SSSE3
+    static char* encodeBlock(char* p, const double* data, std::size_t length)
+    {
+      std::size_t i = 0;
+#ifdef MSGPACK_SSSE3__
+      for (; length - i >= 2; i += 2, p += 18)
+        detail::encode_doubles(p, data + i);
+#endif
+      for (; i < length; i++)
+        p = encode(p, data[i]);
+      return p;
+    }
 
-// Forward definition
-template<typename type>
-class ObjectImpl;
+    //! Initialize the header for a given container
+    template<typename T> inline
+    void initContainer(std::size_t& length, T&)
+    {
+      packArrayHeader(length);
+    }
 
-} // namespace detail
+    //! Inintialize the header for a pair
+    template<typename key, typename val> inline
+    void initContainer(std::size_t& length, std::pair<const val, key>&)
+    {
+      packMapHeader(length);
+    }
+
+    //! Pack an integral value or an user defined type
+    template<typename T> inline
+    Packer& packItem(const T& item, detail::int_tag<detail::NO_USER_TYPE>)
+    {
+      return pack((int64_t) item);
+    }
+
+    template<typename T> inline
+    Packer& packItem(const T& item, detail::int_tag<detail::FIELDS_TYPE>)
+    {
+      item.msgpack_pack(*this);
+      return *this;
+    }
+
+    template<typename T> inline
+    Packer& packItem(const T& item, detail::int_tag<detail::PARCELABLE_TYPE>)
+    {
+      return pack((const Parcelable&) item);
+    }
+
+    std::ostream* out_; //!< The output stream where the data is packed in
+    char* begin_;       //!< Start of the output buffer
+    char* cur_;         //!< Next write position in the output buffer
+    char* end_;         //!< End of the output buffer
+    std::size_t referenceLength_; //!< Raw payloads handed to reference()
+
+  protected:
+
+    uint64_t elements_; //!< Top level elements packed so far
+    uint64_t pending_;  //!< Nested elements announced by headers but not packed yet
+
+}; // Packer
 
 /**
- * Object class. Represents a piece of deserialized
- * data, and provides access to the data itself.
+ * BufferPacker class. Packs the data into a growable contiguous
+ * container of the Buffer type (std::vector<char>, std::string...),
+ * which is only written into a stream when flush() is called.
  */
-class Object
+template<typename Buffer = std::vector<char> >
+class BufferPacker : public Packer
 {
   public:
 
     /**
-     * Destructor
+     * Constructor
+     * @param capacity Initial capacity of the buffer in bytes
      */
-    virtual ~Object() {}
+    explicit BufferPacker(std::size_t capacity = 0)
+    {
+      reserve(capacity);
+    }
+
+    //! Pointer to the packed data
+    const char* data() const
+    {
+      return buffer_.empty() ? 0 : (const char*) &buffer_[0];
+    }
+
+    //! Number of bytes packed so far
+    std::size_t size() const
+    {
+      return used();
+    }
+
+    //! Number of bytes which can be packed before growing the buffer
+    std::size_t capacity() const
+    {
+      return buffer_.size();
+    }
+
+    //! Make room for at least the given number of bytes
+    void reserve(std::size_t capacity)
+    {
+      if (capacity > buffer_.size())
+        grow(capacity);
+    }
+
+    //! Discard the packed data, keeping the allocated buffer
+    void clear()
+    {
+      char* begin = buffer_.empty() ? 0 : (char*) &buffer_[0];
+      setBuffer(begin, begin, begin + buffer_.size());
+      open_.clear();
+      elements_ = 0;
+      pending_ = 0;
+    }
 
     /**
-     * Retrieve the object type for the
-     * current Object.
+     * Start an array whose length is not known yet, e.g. the rows read
+     * from a cursor. Its elements are packed right after it, and the
+     * array is closed by endArray(). Arrays and maps can be nested.
      */
-    object_type getType() const
+    BufferPacker& beginArray()
     {
-      return type_;
+      return beginContainer(bm::MP_ARRAY32);
     }
 
     /**
-     * Returns true if this object represents
-     * a nil instance.
+     * Start a map whose length is not known yet. Its keys and values
+     * are packed right after it, and the map is closed by endMap().
      */
-    virtual bool isNil() const
+    BufferPacker& beginMap()
     {
-      return false;
+      return beginContainer(bm::MP_MAP32);
     }
 
-    template<object_type object_t>
-    detail::ObjectImpl<typename detail::type_traits<object_t>::type>& getImpl() throw(std::bad_cast)
+    /**
+     * Close the innermost array started with beginArray(), writing the
+     * number of elements packed since then into its header.
+     * @param compact Use the shortest header for that number, moving
+     * the elements, instead of the widest one reserved
+     */
+    BufferPacker& endArray(bool compact = false)
     {
-      return getImpl<typename detail::type_traits<object_t>::type>();
+      return endContainer(bm::MP_ARRAY32, bm::MP_ARRAY16, bm::MP_FIXARRAY, compact);
     }
 
-    template<typename T>
-    detail::ObjectImpl<T>& getImpl() throw(std::bad_cast)
+    /**
+     * Close the innermost map started with beginMap(), writing the
+     * number of entries packed since then into its header.
+     * @param compact Use the shortest header for that number, moving
+     * the entries, instead of the widest one reserved
+     */
+    BufferPacker& endMap(bool compact = false)
     {
-      if(detail::type_cast<T>::id!=type_)
-        throw std::bad_cast();
+      return endContainer(bm::MP_MAP32, bm::MP_MAP16, bm::MP_FIXMAP, compact);
+    }
 
-      return *((detail::ObjectImpl<T>*) this);
+    //! Write the packed data into the given stream and clear the buffer
+    void flush(std::ostream& out)
+    {
+      out.write(data(), size());
+      clear();
+    }
+
+    /**
+     * Move the packed data into the given container,
+     * leaving the packer empty.
+     */
+    void release(Buffer& out)
+    {
+      buffer_.resize(size());
+      std::swap(buffer_, out);
+      Buffer().swap(buffer_);
+      setBuffer(0, 0, 0);
+      open_.clear();
+      elements_ = 0;
+      pending_ = 0;
     }
 
   protected:
 
+    void overflow(const char* data, std::size_t length)
+    {
+      std::size_t pos = used();
+      grow(pos + length);
+      std::memcpy(&buffer_[pos], data, length);
+      char* begin = (char*) &buffer_[0];
+      setBuffer(begin, begin + pos + length, begin + buffer_.size());
+    }
+
+  private:
+
+    enum { HEADER32_SIZE = 5 }; //!< Size of the headers reserved by beginArray() and beginMap()
+
+    BufferPacker(const BufferPacker&);
+    BufferPacker& operator=(const BufferPacker&);
+
+    //! A container started with beginArray() or beginMap()
+    struct OpenContainer
+    {
+      std::size_t pos;    //!< Position of its header
+      uint64_t elements;  //!< Top level elements packed before it
+      uint64_t pending;   //!< Nested elements pending before it
+    };
+
     /**
-     * Protected constructor. This is a virtual class.
-     * @param type Type handled by the current object instance.
+     * Write the widest header of the given kind, to be patched later.
+     * The elements packed from then on are counted for the container.
      */
-    template<typename type>
-    Object(type) : type_(detail::type_cast<type>::id) {}
+    BufferPacker& beginContainer(uint8_t header32)
+    {
+      element(0);
+      OpenContainer open = { used(), elements_, pending_ };
+      open_.push_back(open);
+      elements_ = 0;
+      pending_ = 0;
+      write(header32);
+      write<uint32_t>(0);
+      return *this;
+    }
 
-  private:
-    const object_type type_; //!< Type of the current object
+    //! Patch the header of the innermost open container
+    BufferPacker& endContainer(uint8_t header32, uint8_t header16, uint8_t fix, bool compact)
+    {
+      if (open_.empty() || (uint8_t) buffer_[open_.back().pos] != header32)
+        throw pack_exception("No matching container to close");
+      if (pending_ > 0)
+        throw pack_exception("Container closed with missing elements");
+
+      std::size_t pos = open_.back().pos;
+      std::size_t start = pos + HEADER32_SIZE;
+      std::size_t length = used() - start;
+      char* begin = (char*) &buffer_[0];
+
+      uint64_t count = elements_;
+      if (header32 == bm::MP_MAP32)
+      {
+        if (count % 2 != 0)
+          throw pack_exception("Map closed with a key without value");
+        count /= 2;
+      }
+      if (count > bm::MAX_32BIT)
+        throw pack_exception("Too many elements in container");
+      elements_ = open_.back().elements;
+      pending_ = open_.back().pending;
+      open_.pop_back();
+
+      std::size_t headerSize = HEADER32_SIZE;
+      if (compact && count <= bm::MAX_4BIT)
+      {
+        begin[pos] = (char) (fix | count);
+        headerSize = 1;
+      }
+      else if (compact && count <= bm::MAX_16BIT)
+      {
+        begin[pos] = (char) header16;
+        detail::store_network(begin + pos + 1, (uint16_t) count);
+        headerSize = 3;
+      }
+      else
+      {
+        detail::store_network(begin + pos + 1, (uint32_t) count);
+      }
 
-}; // Object
+      if (headerSize != HEADER32_SIZE)
+      {
+        std::memmove(begin + pos + headerSize, begin + start, length);
+        setBuffer(begin, begin + pos + headerSize + length, begin + buffer_.size());
+      }
+      return *this;
+    }
 
-namespace detail
-{
+    //! Grow the buffer to hold at least the given number of bytes
+    void grow(std::size_t capacity)
+    {
+      std::size_t pos = used();
+      std::size_t size = buffer_.size() * 2;
+      if (size < 64)
+        size = 64;
+      if (size < capacity)
+        size = capacity;
+
+      buffer_.resize(size);
+      char* begin = (char*) &buffer_[0];
+      setBuffer(begin, begin + pos, begin + size);
+    }
+
+    Buffer buffer_; //!< The buffer where the data is packed in
+    std::vector<OpenContainer> open_; //!< The open containers, innermost last
+
+}; // BufferPacker
 
 /**
- * Class ObjectImpl. Internal implementation for the speific Object types
- * that handle fixed length types, except for nil.
+ * BufferPacker specialization for a caller supplied memory
+ * region. A {@see pack_exception} is thrown should the
+ * packed data not fit in the region.
  */
-template<typename T>
-class ObjectImpl: public Object
+template<>
+class BufferPacker<char*> : public Packer
 {
   public:
-  static const object_type obj_type = detail::type_cast<T>::id; //<! My type
 
-  /**
-   * Constructor.
-   * @param value Value contained by the Object. There's a implicit
-   * copy performed here.
-   */
-  ObjectImpl(const T& value) : Object(T()), value_(value)
-  {
-  }
+    /**
+     * Constructor
+     * @param data Pointer to the memory region
+     * @param length Length of the memory region in bytes
+     */
+    BufferPacker(char* data, std::size_t length)
+    {
+      setBuffer(data, data, data + length);
+    }
 
-  /**
-   * Retrieve value
-   */
-  const T& getValue() const
-  {
-    return value_;
-  }
+    //! Number of bytes packed so far
+    std::size_t size() const
+    {
+      return used();
+    }
 
-  virtual ~ObjectImpl() {}
+  private:
+
+    BufferPacker(const BufferPacker&);
+    BufferPacker& operator=(const BufferPacker&);
+
+}; // BufferPacker<char*>
+
+/**
+ * SizePacker class. Walks the same pack() methods as any other
+ * Packer, but just counts the number of bytes that would be
+ * written, so that output buffers can be sized up front.
+ */
+class SizePacker : public Packer
+{
+  public:
+
+    /**
+     * Constructor
+     */
+    SizePacker() : size_(0) {}
+
+    //! Number of bytes packed so far
+    std::size_t size() const
+    {
+      return size_;
+    }
+
+    //! Reset the byte count
+    void clear()
+    {
+      size_ = 0;
+    }
 
   protected:
 
-  ObjectImpl() : Object(T()) {}
+    void overflow(const char*, std::size_t length)
+    {
+      size_ += length;
+    }
 
-  T value_; //< Instance of the data handled by the Object
+  private:
 
-}; // ObjectImpl
+    std::size_t size_; //!< Number of bytes packed
 
-struct nil_type {};
+}; // SizePacker
 
 /**
- * Nil class. Represents a nil object.
+ * SegmentPacker class. Packs any number of messages into a chain of
+ * fixed size segments, which are handed out as a list of slices of
+ * memory, so that they can be sent with a single writev() or sendmsg()
+ * call. Raw payloads of at least the reference length are not copied
+ * but referenced by their own slice, so they must remain valid until
+ * the data is sent. Segments are kept for reuse on clear().
  */
-class NilObject : public ObjectImpl<nil_type>
+class SegmentPacker : public Packer
 {
   public:
 
-  NilObject() {} //<! Constructor
+    /**
+     * Constructor
+     * @param segmentSize Size of each segment in bytes
+     * @param referenceLength Minimum length of the raw payloads
+     * which are referenced instead of copied
+     */
+    explicit SegmentPacker(std::size_t segmentSize = 4096,
+        std::size_t referenceLength = 1024) :
+      segmentSize_(segmentSize > 0 ? segmentSize : 1),
+      current_(0), sliceStart_(0), size_(0)
+    {
+      setReferenceLength(referenceLength);
+      segments_.push_back(new char[segmentSize_]);
+      setBuffer(segments_[0], segments_[0], segments_[0] + segmentSize_);
+    }
 
-  bool isNil() const
-  {
-    // I'm the nil guy!
-    return true;
-  }
-};
+    /**
+     * Destructor
+     */
+    ~SegmentPacker()
+    {
+      for (std::size_t i = 0; i < segments_.size(); i++)
+        delete[] segments_[i];
+    }
 
+    /**
+     * Slices of memory holding all the data packed so far, in order.
+     * Each slice maps to an iovec entry, iov_base being the data
+     * and iov_len the size.
+     */
+    const std::vector<RawRef>& slices()
+    {
+      closeSlice();
+      return slices_;
+    }
 
-/**
- * Declaration of the types correspondences with
- * their specific data types
- */
+    //! Number of bytes packed so far
+    std::size_t size() const
+    {
+      return size_ + used() - sliceStart_;
+    }
 
-#define TYPE_CAST(__ID__, __TYPE__) \
-    template<> \
-    struct type_cast<__TYPE__> \
-    { \
-    static const object_type id = __ID__;\
-    };
+    //! Discard the packed data, keeping the allocated segments
+    void clear()
+    {
+      slices_.clear();
+      size_ = 0;
+      elements_ = 0;
+      pending_ = 0;
+      useSegment(0);
+    }
 
-#define TYPE_TRAITS(__ID__, __TYPE__) \
-    template<> \
-    struct type_traits<__ID__> \
-    { \
-    typedef __TYPE__ type; \
-    }; \
-    TYPE_CAST(__ID__, __TYPE__)
+    //! Write the packed data into the given stream and clear the packer
+    void flush(std::ostream& out)
+    {
+      const std::vector<RawRef>& list = slices();
+      for (std::size_t i = 0; i < list.size(); i++)
+        out.write(list[i].data, list[i].size);
+      clear();
+    }
 
-TYPE_TRAITS(NIL,    nil_type)
-TYPE_TRAITS(BOOL,   bool)
-TYPE_TRAITS(INT8,   int8_t)
-TYPE_TRAITS(INT16,  int16_t)
-TYPE_TRAITS(INT32,  int32_t)
-TYPE_TRAITS(INT64,  int64_t)
-TYPE_TRAITS(UINT8,  uint8_t)
-TYPE_TRAITS(UINT16, uint16_t)
-TYPE_TRAITS(UINT32, uint32_t)
-TYPE_TRAITS(UINT64, uint64_t)
-TYPE_TRAITS(FLOAT,  float)
-TYPE_TRAITS(DOUBLE, double)
+    /**
+     * Move the data packed by other after the data packed so far,
+     * and clear other. The segments of other are taken over without
+     * any copies when they have the same size as those of this packer.
+     */
+    void append(SegmentPacker& other)
+    {
+      if (&other == this)
+        return;
 
-typedef uint8_t* raw_type;
-TYPE_TRAITS(RAW,    raw_type)
-TYPE_CAST  (RAW,    std::string) // Type cast is implemented for raw type
-TYPE_CAST  (RAW,    std::wstring)
+      elements(other.elements_);
+      const std::vector<RawRef>& list = other.slices();
+      if (other.segmentSize_ != segmentSize_)
+      {
+        for (std::size_t i = 0; i < list.size(); i++)
+          write(list[i].data, list[i].size);
+        other.clear();
+        return;
+      }
 
-typedef std::list<Object*> array_type;
-TYPE_TRAITS(ARRAY,    std::list<Object*>)
+      closeSlice();
+      slices_.insert(slices_.end(), list.begin(), list.end());
+      size_ += other.size_;
+
+      // The segments in use go before the current one, the rest are kept for reuse
+      std::vector<char*>::iterator used = other.segments_.begin() + other.current_ + 1;
+      segments_.insert(segments_.begin() + current_, other.segments_.begin(), used);
+      current_ += used - other.segments_.begin();
+      other.segments_.erase(other.segments_.begin(), used);
+      if (other.segments_.empty())
+        other.segments_.push_back(new char[segmentSize_]);
+      other.clear();
+    }
 
-typedef std::multimap<Object*,Object*> map_type;
-TYPE_TRAITS(MAP,    detail::map_type)
+    //! Size of each segment in bytes
+    std::size_t segmentSize() const
+    {
+      return segmentSize_;
+    }
 
-/**
- * ObjectImpl class specilization for the ARRAY type.
- */
-class ArrayObject : public ObjectImpl<array_type>
-{
-  public:
+    //! Minimum length of the raw payloads which are referenced
+    std::size_t referenceLength() const
+    {
+      return getReferenceLength();
+    }
 
-  /**
-   * Destructor. Removes and deletes all the Objects
-   * contained in the array.
-   */
-  virtual ~ArrayObject()
-  {
-    array_type::iterator it = value_.begin();;
-    while(it!=value_.end())
+  protected:
+
+    void overflow(const char* data, std::size_t length)
     {
-      delete *it;
-      *it = 0;
-      it++;
+      for (;;)
+      {
+        std::size_t pos = used();
+        std::size_t chunk = segmentSize_ - pos;
+        if (chunk > length)
+          chunk = length;
+
+        char* begin = segments_[current_];
+        std::memcpy(begin + pos, data, chunk);
+        setBuffer(begin, begin + pos + chunk, begin + segmentSize_);
+
+        data += chunk;
+        length -= chunk;
+        if (length == 0)
+          break;
+
+        closeSlice();
+        useSegment(current_ + 1);
+      }
     }
-    value_.clear();
-  }
 
-  /**
-   * Add a new object to the array, which
-   * will be owned and deleted by it on destruction.
-   */
-  void add(Object* o)
-  {
-    value_.push_back(o);
-  }
-};
+    void reference(const char* data, std::size_t length)
+    {
+      closeSlice();
+      slices_.push_back(RawRef(data, length));
+      size_ += length;
+    }
 
-/**
- * ObjectImpl class specilization for the MAP type.
- */
-class MapObject : public ObjectImpl<map_type>
-{
-  public:
+  private:
 
-  /**
-   * Destructor. Removes and deletes all the Object keys
-   * and values contained in the map.
-   */
-  virtual ~MapObject()
-  {
-    map_type::iterator it = value_.begin();;
-    while(it!=value_.end())
+    SegmentPacker(const SegmentPacker&);
+    SegmentPacker& operator=(const SegmentPacker&);
+
+    //! Add the data packed into the current segment since the last slice
+    void closeSlice()
     {
-      delete it->first;
-      delete it->second;
-      it++;
+      std::size_t pos = used();
+      if (pos > sliceStart_)
+      {
+        slices_.push_back(RawRef(segments_[current_] + sliceStart_, pos - sliceStart_));
+        size_ += pos - sliceStart_;
+        sliceStart_ = pos;
+      }
     }
-    value_.clear();
-  }
 
-  /**
-   * Insert a new pair key-value into the map, which
-   * will be owned and deleted by it on destruction.
-   */
-  void insert(Object* key, Object* val)
-  {
-    value_.insert(map_type::value_type(key, val));
-  }
-};
+    //! Move to the given segment, allocating it if needed
+    void useSegment(std::size_t index)
+    {
+      if (index == segments_.size())
+        segments_.push_back(new char[segmentSize_]);
+
+      current_ = index;
+      sliceStart_ = 0;
+      char* begin = segments_[current_];
+      setBuffer(begin, begin, begin + segmentSize_);
+    }
+
+    std::size_t segmentSize_;      //!< Size of each segment
+    std::vector<char*> segments_;  //!< The segments, kept for reuse
+    std::size_t current_;          //!< Segment being packed into
+    std::size_t sliceStart_;       //!< Start of the open slice in the segment
+    std::size_t size_;             //!< Number of bytes in the closed slices
+    std::vector<RawRef> slices_;   //!< The closed slices
+
+}; // SegmentPacker
+
+template<typename T> inline
+std::size_t Packer::packedSize(const T& value)
+{
+  SizePacker packer;
+  packer.pack(value);
+  return packer.size();
+}
 
 /**
- * ObjectImpl class specilization for the RAW type.
+ * Fragment class. Immutable element encoded once, e.g. the constant
+ * parts of the outgoing messages, and then spliced into any Packer
+ * stream as raw bytes with {@see Packer::pack(const Fragment&)}.
  */
-class RawObject : public ObjectImpl<raw_type>
+class Fragment
 {
   public:
 
-  /**
-   * Constructor
-   * @param value Reference to the data region handled
-   * by the Object, which ownership is now from
-   * the current Object which will destroy it on
-   * deletion.
-   * @param size Number of items held by this object
-   */
-  RawObject(raw_type value, std::size_t size) : ObjectImpl<raw_type>(value), size_(size)
-  {
-  }
+    /**
+     * Constructor. Holds a nil element.
+     */
+    Fragment() : bytes_(1, (char) bm::MP_NULL) {}
 
-  /**
-   * Destructor
-   */
-  virtual ~RawObject()
-  {
-    delete[] value_;
-  }
+    /**
+     * Constructor. Encodes the given value.
+     * @param value Reference to the value to be encoded
+     */
+    template<typename T>
+    explicit Fragment(const T& value)
+    {
+      BufferPacker<> packer;
+      packer.pack(value);
+      bytes_.assign(packer.data(), packer.data() + packer.size());
+    }
 
-  template<typename char_t>
-  operator std::basic_string<char_t>() const
-  {
-    std::basic_string<char_t> str;
-    std::copy((char_t*)value_, (char_t*)(value_+size_), std::back_inserter(str));
-    return str;
-  }
+    /**
+     * Build a Fragment from data already encoded, which must hold
+     * exactly one element, or a pack_exception is thrown.
+     * @param data Pointer to the encoded element
+     * @param length Length of the encoded element in bytes
+     */
+    static Fragment encoded(const char* data, std::size_t length) MSGPACK_THROW__(pack_exception)
+    {
+      if (detail::count_elements(data, length) != 1)
+        throw pack_exception("Fragments must hold exactly one element");
+
+      Fragment ret;
+      ret.bytes_.assign(data, data + length);
+      return ret;
+    }
+
+    //! Pointer to the encoded element
+    const char* data() const
+    {
+      return &bytes_[0];
+    }
+
+    //! Length of the encoded element in bytes
+    std::size_t size() const
+    {
+      return bytes_.size();
+    }
 
   private:
 
-  RawObject() {}
+    std::vector<char> bytes_; //!< The encoded element
 
-  std::size_t size_;
-};
+}; // Fragment
 
-//! Utility struct that allows to remove the pointer part of a given type
-template<typename T>
-struct remove_pointer { typedef T type; };
-template<typename T>
-struct remove_pointer<T*> { typedef typename remove_pointer<T>::type type; };
+inline Packer& Packer::pack(const Fragment& fragment)
+{
+  element(0);
+  return write(fragment.data(), fragment.size());
+}
 
-} // namespace detail
+/**
+ * Type enum type defines all the possible output types
+ * for the {@see #Object} instances generated by
+ * the {@see #Unpacker} class
+ */
+enum object_type
+{
+  NIL,      //<! nulll
+  BOOL,     //<! boolean [true, false]
+  INT8,     //<! int8 [positive, negative fixnum]
+  INT16,    //<! int16
+  INT32,    //<! int32
+  INT64,    //<! int64
+  UINT8,    //<! uint8
+  UINT16,   //<! uint16
+  UINT32,   //<! uint32
+  UINT64,   //<! uint64
+  FLOAT,    //<! float
+  DOUBLE,   //<! double
+  RAW,      //<! Raw bytes [fix raw, raw 16, raw 32]
+  ARRAY,    //<! Array [fix array, array 16, array 32]
+  MAP       //<! Map [fix map, map 16, map 32]
 
-typedef detail::NilObject                                        Nil;
-typedef detail::ObjectImpl<detail::type_traits<BOOL  >::type>   Bool;
-typedef detail::ObjectImpl<detail::type_traits<INT8  >::type>   Int8;
-typedef detail::ObjectImpl<detail::type_traits<INT16 >::type>  Int16;
-typedef detail::ObjectImpl<detail::type_traits<INT32 >::type>  Int32;
-typedef detail::ObjectImpl<detail::type_traits<INT64 >::type>  Int64;
-typedef detail::ObjectImpl<detail::type_traits<UINT8 >::type>  UInt8;
+}; // object_type
+
+/**
+ * Arena class. Provides fast allocation of memory blocks which
+ * are only released all at once, either on reset(), which keeps the
+ * allocated chunks for later reuse, or on destruction.
+ * See {@see Unpacker::unpack(Arena&)}.
+ */
+class Arena
+{
+  public:
+
+    /**
+     * Constructor
+     * @param chunkSize Size in bytes of the chunks requested to the
+     * global allocator when the arena runs out of memory.
+     */
+    explicit Arena(std::size_t chunkSize = 4096) :
+      chunkSize_(chunkSize), capacity_(0), first_(0), current_(0), cur_(0), end_(0) {}
+
+    /**
+     * Destructor. Releases all the allocated chunks.
+     */
+    ~Arena()
+    {
+      release();
+    }
+
+    /**
+     * Allocate a memory block, suitably aligned for any type
+     * @param size Size of the block in bytes
+     */
+    void* allocate(std::size_t size)
+    {
+      size = (size + ALIGNMENT - 1) & ~std::size_t(ALIGNMENT - 1);
+      if (std::size_t(end_ - cur_) < size)
+        nextChunk(size);
+
+      void* ret = cur_;
+      cur_ += size;
+      return ret;
+    }
+
+    /**
+     * Release all the memory blocks at once. The chunks are kept
+     * and reused by the following allocations.
+     */
+    void reset()
+    {
+      use(first_);
+    }
+
+    /**
+     * Release all the memory blocks at once, returning the
+     * chunks to the global allocator.
+     */
+    void release()
+    {
+      while (first_ != 0)
+      {
+        Chunk* next = first_->next;
+        ::operator delete(first_);
+        first_ = next;
+      }
+      capacity_ = 0;
+      use(0);
+    }
+
+    //! Number of bytes held in chunks
+    std::size_t capacity() const
+    {
+      return capacity_;
+    }
+
+  private:
+
+    enum { ALIGNMENT = 16 };
+
+    //! Header of a chunk of memory, the data follows it
+    struct Chunk
+    {
+      Chunk* next;
+      std::size_t size;
+    };
+
+    enum { HEADER_SIZE = (sizeof(Chunk) + ALIGNMENT - 1) & ~(ALIGNMENT - 1) };
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    //! Make the given chunk the current one
+    void use(Chunk* chunk)
+    {
+      current_ = chunk;
+      cur_ = chunk ? ((char*) chunk) + HEADER_SIZE : 0;
+      end_ = chunk ? cur_ + chunk->size : 0;
+    }
+
+    //! Move to a chunk with room for at least size bytes
+    void nextChunk(std::size_t size)
+    {
+      // Reuse the chunks kept from before the last reset
+      Chunk* next = current_ ? current_->next : first_;
+      if (next != 0 && next->size >= size)
+      {
+        use(next);
+        return;
+      }
+
+      std::size_t chunkSize = size > chunkSize_ ? size : chunkSize_;
+      Chunk* chunk = (Chunk*) ::operator new(HEADER_SIZE + chunkSize);
+      chunk->size = chunkSize;
+      chunk->next = next;
+      capacity_ += chunkSize;
+      if (current_ != 0)
+        current_->next = chunk;
+      else
+        first_ = chunk;
+      use(chunk);
+    }
+
+    std::size_t chunkSize_; //!< Default size for new chunks
+    std::size_t capacity_;  //!< Total size of the chunks
+    Chunk* first_;          //!< First chunk in the list
+    Chunk* current_;        //!< Chunk the memory is taken from
+    char* cur_;             //!< Next free position in the current chunk
+    char* end_;             //!< End of the current chunk
+
+}; // Arena
+
+namespace detail
+{
+
+/**
+ * STL allocator taking the memory from an Arena, or from
+ * the global allocator if no Arena is provided.
+ */
+template<typename T>
+class arena_allocator
+{
+  public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template<typename U>
+    struct rebind { typedef arena_allocator<U> other; };
+
+    arena_allocator(Arena* arena = 0) : arena_(arena) {}
+
+    template<typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena_(other.arena()) {}
+
+    pointer allocate(size_type n, const void* = 0)
+    {
+      return (pointer) (arena_ ? arena_->allocate(n * sizeof(T)) :
+          ::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type)
+    {
+      // Arena memory is released all at once
+      if (arena_ == 0)
+        ::operator delete(p);
+    }
+
+    void construct(pointer p, const T& val) { new ((void*) p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+
+    size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    Arena* arena() const { return arena_; }
+
+    template<typename U>
+    bool operator==(const arena_allocator<U>& other) const { return arena_ == other.arena(); }
+    template<typename U>
+    bool operator!=(const arena_allocator<U>& other) const { return arena_ != other.arena(); }
+
+  private:
+    Arena* arena_; //!< Arena the memory is taken from, if any
+};
+
+/**
+ * This defines the primary relationship
+ * between an object_type and the data
+ * type that is actually handled by it
+ */
+template<object_type t>
+struct type_traits {
+};
+
+/**
+ * This defines the possible casts
+ * from a given type T to an object type.
+ */
+template<typename T>
+struct type_cast {
+};
+
+// Forward definition
+template<typename type>
+class ObjectImpl;
+
+} // namespace detail
+
+/**
+ * Object class. Represents a piece of deserialized
+ * data, and provides access to the data itself.
+ */
+class Object
+{
+  public:
+
+    /**
+     * Destructor
+     */
+    virtual ~Object() {}
+
+    /**
+     * Retrieve the object type for the
+     * current Object.
+     */
+    object_type getType() const
+    {
+      return type_;
+    }
+
+    /**
+     * Returns true if this object represents
+     * a nil instance.
+     */
+    virtual bool isNil() const
+    {
+      return false;
+    }
+
+    template<object_type object_t>
+    detail::ObjectImpl<typename detail::type_traits<object_t>::type>& getImpl() MSGPACK_THROW__(std::bad_cast)
+    {
+      return getImpl<typename detail::type_traits<object_t>::type>();
+    }
+
+    template<typename T>
+    detail::ObjectImpl<T>& getImpl() MSGPACK_THROW__(std::bad_cast)
+    {
+      if(detail::type_cast<T>::id!=type_)
+        throw std::bad_cast();
+
+      return *((detail::ObjectImpl<T>*) this);
+    }
+
+  protected:
+
+    /**
+     * Protected constructor. This is a virtual class.
+     * @param type Type handled by the current object instance.
+     */
+    template<typename type>
+    Object(type) : type_(detail::type_cast<type>::id) {}
+
+  private:
+    const object_type type_; //!< Type of the current object
+
+}; // Object
+
+namespace detail
+{
+
+/**
+ * Class ObjectImpl. Internal implementation for the speific Object types
+ * that handle fixed length types, except for nil.
+ */
+template<typename T>
+class ObjectImpl: public Object
+{
+  public:
+  static const object_type obj_type = detail::type_cast<T>::id; //<! My type
+
+  /**
+   * Constructor.
+   * @param value Value contained by the Object. There's a implicit
+   * copy performed here.
+   */
+  ObjectImpl(const T& value) : Object(T()), value_(value)
+  {
+  }
+
+  /**
+   * Retrieve value
+   */
+  const T& getValue() const
+  {
+    return value_;
+  }
+
+  virtual ~ObjectImpl() {}
+
+  protected:
+
+  ObjectImpl() : Object(T()) {}
+
+  T value_; //< Instance of the data handled by the Object
+
+}; // ObjectImpl
+
+struct nil_type {};
+
+/**
+ * Nil class. Represents a nil object.
+ */
+class NilObject : public ObjectImpl<nil_type>
+{
+  public:
+
+  NilObject() {} //<! Constructor
+
+  bool isNil() const
+  {
+    // I'm the nil guy!
+    return true;
+  }
+};
+
+
+/**
+ * Declaration of the types correspondences with
+ * their specific data types
+ */
+
+#define TYPE_CAST(__ID__, __TYPE__) \
+    template<> \
+    struct type_cast<__TYPE__> \
+    { \
+    static const object_type id = __ID__;\
+    };
+
+#define TYPE_TRAITS(__ID__, __TYPE__) \
+    template<> \
+    struct type_traits<__ID__> \
+    { \
+    typedef __TYPE__ type; \
+    }; \
+    TYPE_CAST(__ID__, __TYPE__)
+
+TYPE_TRAITS(NIL,    nil_type)
+TYPE_TRAITS(BOOL,   bool)
+TYPE_TRAITS(INT8,   int8_t)
+TYPE_TRAITS(INT16,  int16_t)
+TYPE_TRAITS(INT32,  int32_t)
+TYPE_TRAITS(INT64,  int64_t)
+TYPE_TRAITS(UINT8,  uint8_t)
+TYPE_TRAITS(UINT16, uint16_t)
+TYPE_TRAITS(UINT32, uint32_t)
+TYPE_TRAITS(UINT64, uint64_t)
+TYPE_TRAITS(FLOAT,  float)
+TYPE_TRAITS(DOUBLE, double)
+
+typedef uint8_t* raw_type;
+TYPE_TRAITS(RAW,    raw_type)
+TYPE_CAST  (RAW,    std::string) // Type cast is implemented for raw type
+TYPE_CAST  (RAW,    std::wstring)
+
+/**
+ * ObjectImpl class specilization for the RAW type.
+ */
+class RawObject : public ObjectImpl<raw_type>
+{
+  public:
+
+  /**
+   * Constructor
+   * @param value Reference to the data region handled
+   * by the Object, which ownership is now from
+   * the current Object which will destroy it on
+   * deletion.
+   * @param size Number of items held by this object
+   * @param owned If false the data region is just referenced
+   * and will not be deleted by this Object.
+   * @param shared If true the Object is an interned map key
+   * owned by a {@see KeyCache}, not by the maps holding it.
+   */
+  RawObject(raw_type value, std::size_t size, bool owned = true, bool shared = false) :
+    ObjectImpl<raw_type>(value), size_(size), owned_(owned), shared_(shared)
+  {
+  }
+
+  /**
+   * Destructor
+   */
+  virtual ~RawObject()
+  {
+    if(owned_)
+      delete[] value_;
+  }
+
+  /**
+   * Length of the data region in bytes
+   */
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  /**
+   * Returns false if the data region is a view into
+   * the Unpacker buffer not owned by this Object.
+   */
+  bool isOwner() const
+  {
+    return owned_;
+  }
+
+  /**
+   * Returns true if this Object is an interned map key, which
+   * is shared by all the maps where it appears.
+   */
+  bool isShared() const
+  {
+    return shared_;
+  }
+
+  template<typename char_t>
+  operator std::basic_string<char_t>() const
+  {
+    std::basic_string<char_t> str;
+    assignTo(str);
+    return str;
+  }
+
+  /**
+   * Copy the data region into the given string in one go,
+   * reusing its capacity when it is large enough.
+   */
+  template<typename char_t>
+  void assignTo(std::basic_string<char_t>& str) const
+  {
+    std::size_t length = size_ / sizeof(char_t);
+    str.reserve(length);
+    str.assign((const char_t*) value_, length);
+  }
+
+  /**
+   * Transfer the data region to the caller, who must delete[] it.
+   * An owned region is handed over without copies, leaving this
+   * Object empty. Views into the Unpacker buffer or an Arena and
+   * interned keys are copied and left as they are.
+   */
+  raw_type release()
+  {
+    if (owned_ && !shared_)
+    {
+      raw_type value = value_;
+      value_ = 0;
+      size_ = 0;
+      owned_ = false;
+      return value;
+    }
+
+    raw_type copy = new uint8_t[size_];
+    std::memcpy(copy, value_, size_);
+    return copy;
+  }
+
+  private:
+
+  RawObject() {}
+
+  std::size_t size_;
+  bool owned_;
+  bool shared_;
+};
+
+typedef std::vector<Object*, arena_allocator<Object*> > array_type;
+TYPE_TRAITS(ARRAY,    detail::array_type)
+
+typedef std::pair<Object*, Object*> map_entry;
+typedef std::vector<map_entry, arena_allocator<map_entry> > map_type;
+TYPE_TRAITS(MAP,    detail::map_type)
+
+/**
+ * ObjectImpl class specilization for the ARRAY type.
+ */
+class ArrayObject : public ObjectImpl<array_type>
+{
+  public:
+
+  /**
+   * Constructor
+   * @param arena If provided, the Arena holding the array nodes.
+   */
+  explicit ArrayObject(Arena* arena = 0) :
+    ObjectImpl<array_type>(array_type(array_type::allocator_type(arena)))
+  {
+  }
+
+  /**
+   * Destructor. Removes and deletes all the Objects
+   * contained in the array.
+   */
+  virtual ~ArrayObject()
+  {
+    array_type::iterator it = value_.begin();;
+    while(it!=value_.end())
+    {
+      delete *it;
+      *it = 0;
+      it++;
+    }
+    value_.clear();
+  }
+
+  /**
+   * Add a new object to the array, which
+   * will be owned and deleted by it on destruction.
+   */
+  void add(Object* o)
+  {
+    value_.push_back(o);
+  }
+
+  /**
+   * Reserve room for the given number of elements
+   */
+  void reserve(std::size_t size)
+  {
+    value_.reserve(size);
+  }
+
+  /**
+   * Number of elements in the array
+   */
+  std::size_t size() const
+  {
+    return value_.size();
+  }
+
+  /**
+   * Retrieve the element at the given position
+   */
+  Object* operator[](std::size_t i) const
+  {
+    return value_[i];
+  }
+
+  /**
+   * Take the element at the given position out of the array,
+   * leaving a null pointer in its place. The caller now owns
+   * it and must delete it, unless it was allocated in an Arena.
+   */
+  Object* release(std::size_t i)
+  {
+    Object* o = value_[i];
+    value_[i] = 0;
+    return o;
+  }
+
+  /**
+   * Take all the elements out of the array, in order, which is
+   * left empty. The caller now owns them as with release(i).
+   */
+  template<typename Alloc>
+  void release(std::vector<Object*, Alloc>& out)
+  {
+    out.insert(out.end(), value_.begin(), value_.end());
+    value_.clear();
+  }
+};
+
+/**
+ * ObjectImpl class specilization for the MAP type.
+ */
+class MapObject : public ObjectImpl<map_type>
+{
+  public:
+
+  /**
+   * Constructor
+   * @param arena If provided, the Arena holding the map nodes.
+   */
+  explicit MapObject(Arena* arena = 0) :
+    ObjectImpl<map_type>(map_type(map_type::allocator_type(arena)))
+  {
+  }
+
+  /**
+   * Destructor. Removes and deletes all the Object keys
+   * and values contained in the map, except for the keys
+   * interned in a {@see KeyCache}.
+   */
+  virtual ~MapObject()
+  {
+    map_type::iterator it = value_.begin();;
+    while(it!=value_.end())
+    {
+      if(!isShared(it->first))
+        delete it->first;
+      delete it->second;
+      it++;
+    }
+    value_.clear();
+  }
+
+  /**
+   * Insert a new pair key-value into the map, which
+   * will be owned and deleted by it on destruction.
+   * Entries are kept in insertion order.
+   */
+  void insert(Object* key, Object* val)
+  {
+    value_.push_back(map_type::value_type(key, val));
+  }
+
+  /**
+   * Reserve room for the given number of entries
+   */
+  void reserve(std::size_t size)
+  {
+    value_.reserve(size);
+  }
+
+  /**
+   * Number of entries in the map
+   */
+  std::size_t size() const
+  {
+    return value_.size();
+  }
+
+  /**
+   * Retrieve the entry at the given position
+   */
+  const map_type::value_type& operator[](std::size_t i) const
+  {
+    return value_[i];
+  }
+
+  /**
+   * Look up the value of the first entry whose key is a RAW
+   * with the given contents.
+   * @param key Pointer to the key contents
+   * @param length Length of the key in bytes
+   * @return The value Object, or null if not found
+   */
+  Object* find(const char* key, std::size_t length) const
+  {
+    for (map_type::const_iterator it = value_.begin(); it != value_.end(); ++it)
+    {
+      if (it->first == 0 || it->first->getType() != RAW)
+        continue;
+
+      const RawObject* raw = (const RawObject*) it->first;
+      if (raw->size() == length && std::memcmp(raw->getValue(), key, length) == 0)
+        return it->second;
+    }
+    return 0;
+  }
+
+  /**
+   * Look up the value of the first entry whose key is a RAW
+   * with the given string contents.
+   * @return The value Object, or null if not found
+   */
+  template<typename char_t>
+  Object* find(const std::basic_string<char_t>& key) const
+  {
+    return find((const char*) key.data(), key.size() * sizeof(char_t));
+  }
+
+  /**
+   * Equivalent to find(const std::basic_string<char_t>&) for C strings
+   */
+  Object* find(const char* key) const
+  {
+    return find(key, strlen(key));
+  }
+
+  /**
+   * Take the value of the entry at the given position out of the
+   * map, leaving a null pointer in its place while the key stays
+   * owned by the map. The caller now owns the value and must delete
+   * it, unless it was allocated in an Arena.
+   */
+  Object* release(std::size_t i)
+  {
+    Object* val = value_[i].second;
+    value_[i].second = 0;
+    return val;
+  }
+
+  /**
+   * Take the value of the first entry whose key is a RAW with the
+   * given contents out of the map, as with release(std::size_t).
+   * @return The value Object, or null if not found
+   */
+  Object* release(const char* key, std::size_t length)
+  {
+    for (map_type::iterator it = value_.begin(); it != value_.end(); ++it)
+    {
+      if (it->first == 0 || it->first->getType() != RAW)
+        continue;
+
+      const RawObject* raw = (const RawObject*) it->first;
+      if (raw->size() == length && std::memcmp(raw->getValue(), key, length) == 0)
+        return release(it - value_.begin());
+    }
+    return 0;
+  }
+
+  /**
+   * Equivalent to release(const char*, std::size_t) for strings
+   */
+  template<typename char_t>
+  Object* release(const std::basic_string<char_t>& key)
+  {
+    return release((const char*) key.data(), key.size() * sizeof(char_t));
+  }
+
+  private:
+
+  static bool isShared(const Object* key)
+  {
+    return key != 0 && key->getType() == RAW && ((const RawObject*) key)->isShared();
+  }
+};
+
+//! Utility struct that allows to remove the pointer part of a given type
+template<typename T>
+struct remove_pointer { typedef T type; };
+template<typename T>
+struct remove_pointer<T*> { typedef typename remove_pointer<T>::type type; };
+
+} // namespace detail
+
+typedef detail::NilObject                                        Nil;
+typedef detail::ObjectImpl<detail::type_traits<BOOL  >::type>   Bool;
+typedef detail::ObjectImpl<detail::type_traits<INT8  >::type>   Int8;
+typedef detail::ObjectImpl<detail::type_traits<INT16 >::type>  Int16;
+typedef detail::ObjectImpl<detail::type_traits<INT32 >::type>  Int32;
+typedef detail::ObjectImpl<detail::type_traits<INT64 >::type>  Int64;
+typedef detail::ObjectImpl<detail::type_traits<UINT8 >::type>  UInt8;
 typedef detail::ObjectImpl<detail::type_traits<UINT16>::type> UInt16;
 typedef detail::ObjectImpl<detail::type_traits<UINT32>::type> UInt32;
 typedef detail::ObjectImpl<detail::type_traits<UINT64>::type> UInt64;
@@ -923,354 +2602,2983 @@ typedef detail::ArrayObject                                    Array;
 typedef detail::MapObject                                        Map;
 typedef detail::RawObject                                        Raw;
 
-/**
- * Exception likely to be thrown during the
- * data deserialization.
- */
-typedef std::ios_base::failure unpack_exception;
+/**
+ * Value class. Compact alternative to the Object hierarchy for
+ * representing a piece of deserialized data: a 16 bytes, trivially
+ * destructible tagged union holding the value of scalars inline,
+ * and a pointer and length for RAW, ARRAY and MAP values. Container
+ * elements are stored contiguously in an Arena, the key and value
+ * of each map entry next to each other.
+ * See {@see Unpacker::unpack(Value&, Arena&)}.
+ */
+class Value
+{
+  public:
+
+    /**
+     * Constructor. Builds a nil value.
+     */
+    Value() : type_(NIL), size_(0)
+    {
+      u_.uint64Val = 0;
+    }
+
+    /**
+     * Retrieve the object type for the
+     * current Value.
+     */
+    object_type getType() const
+    {
+      return (object_type) type_;
+    }
+
+    /**
+     * Returns true if this value represents
+     * a nil instance.
+     */
+    bool isNil() const
+    {
+      return type_ == NIL;
+    }
+
+    /**
+     * Retrieve a scalar value converted into the type T, the
+     * same way {@see Unpacker::unpack(T&)} does. Throws
+     * std::bad_cast for nil, RAW, ARRAY and MAP values.
+     */
+    template<typename T>
+    T as() const MSGPACK_THROW__(std::bad_cast)
+    {
+      switch (type_)
+      {
+        case BOOL:   return (T) u_.boolVal;
+        case INT8:
+        case INT16:
+        case INT32:
+        case INT64:  return (T) u_.int64Val;
+        case UINT8:
+        case UINT16:
+        case UINT32:
+        case UINT64: return (T) u_.uint64Val;
+        case FLOAT:  return (T) u_.floatVal;
+        case DOUBLE: return (T) u_.doubleVal;
+        default:     throw std::bad_cast();
+      }
+    }
+
+    /**
+     * Retrieve the data of a RAW value. Throws
+     * std::bad_cast for any other type.
+     */
+    RawRef getRaw() const MSGPACK_THROW__(std::bad_cast)
+    {
+      if (type_ != RAW)
+        throw std::bad_cast();
+
+      return RawRef(u_.rawVal, size_);
+    }
+
+    /**
+     * Number of bytes of a RAW value, elements of
+     * an ARRAY or entries of a MAP. Zero otherwise.
+     */
+    std::size_t size() const
+    {
+      return size_;
+    }
+
+    /**
+     * Retrieve the element at the given position of an ARRAY
+     */
+    const Value& operator[](std::size_t i) const
+    {
+      return u_.values[i];
+    }
+
+    /**
+     * Retrieve the key of the entry at the given position of a MAP
+     */
+    const Value& key(std::size_t i) const
+    {
+      return u_.values[2 * i];
+    }
+
+    /**
+     * Retrieve the value of the entry at the given position of a MAP
+     */
+    const Value& value(std::size_t i) const
+    {
+      return u_.values[2 * i + 1];
+    }
+
+    /**
+     * Look up the value of the first entry of a MAP whose key
+     * is a RAW with the given contents.
+     * @param key Pointer to the key contents
+     * @param length Length of the key in bytes
+     * @return The value, or null if not found
+     */
+    const Value* find(const char* key, std::size_t length) const
+    {
+      if (type_ != MAP)
+        return 0;
+
+      for (std::size_t i = 0; i < size_; i++)
+      {
+        const Value& k = u_.values[2 * i];
+        if (k.type_ == RAW && k.size_ == length && std::memcmp(k.u_.rawVal, key, length) == 0)
+          return &u_.values[2 * i + 1];
+      }
+      return 0;
+    }
+
+    /**
+     * Equivalent to find(const char*, std::size_t) for strings
+     */
+    template<typename char_t>
+    const Value* find(const std::basic_string<char_t>& key) const
+    {
+      return find((const char*) key.data(), key.size() * sizeof(char_t));
+    }
+
+    /**
+     * Equivalent to find(const char*, std::size_t) for C strings
+     */
+    const Value* find(const char* key) const
+    {
+      return find(key, strlen(key));
+    }
+
+  private:
+
+    friend class Unpacker;
+
+    uint8_t type_;  //!< object_type of the value
+    uint32_t size_; //!< Length of RAW, ARRAY and MAP values
+    union
+    {
+      bool boolVal;
+      int64_t int64Val;
+      uint64_t uint64Val;
+      float floatVal;
+      double doubleVal;
+      const char* rawVal;
+      const Value* values;
+    } u_;           //!< The value itself
+
+}; // Value
+
+/**
+ * KeyCache class. Interning table of short RAW map keys, which can
+ * be shared by any number of Unpackers running on the same thread, see
+ * {@see Unpacker::setKeyCache()}. Every distinct key is stored once
+ * as an immutable Raw, and later occurrences of the same bytes resolve
+ * to that very Object without allocating, so keys can be compared by
+ * their address. Once the table is full keys are no longer interned.
+ * The cache owns the interned keys, so it must outlive every Object
+ * unpacked with it. It is not thread safe: interning writes into the
+ * table, so Unpackers on different threads need a cache each.
+ */
+class KeyCache
+{
+  public:
+
+    /**
+     * Constructor
+     * @param capacity Maximum number of keys interned
+     * @param maxLength Longest key interned, in bytes. Only FIXRAW
+     * keys are interned, so it is capped at 31.
+     */
+    explicit KeyCache(std::size_t capacity = 1024, std::size_t maxLength = 31) :
+      capacity_(capacity), maxLength_(maxLength < 31 ? maxLength : 31), size_(0)
+    {
+      std::size_t slots = 1;
+      while (slots < 2 * capacity_)
+        slots <<= 1;
+      slots_.resize(slots, 0);
+    }
+
+    /**
+     * Destructor. Deletes all the interned keys.
+     */
+    ~KeyCache()
+    {
+      clear();
+    }
+
+    /**
+     * Return the interned key with the given contents, interning it
+     * if it was not before.
+     * @return The shared key, or null if the key is too long or the
+     * cache is full.
+     */
+    Raw* intern(const char* data, std::size_t length)
+    {
+      if (length > maxLength_)
+        return 0;
+
+      std::size_t i = lookup(data, length);
+      if (slots_[i] == 0)
+      {
+        if (size_ == capacity_)
+          return 0;
+
+        typedef detail::type_traits<RAW>::type raw_type;
+        typedef detail::remove_pointer<raw_type>::type byte_type;
+
+        raw_type value = new byte_type[length];
+        std::memcpy(value, data, length);
+        slots_[i] = new Raw(value, length, true, true);
+        size_++;
+      }
+      return slots_[i];
+    }
+
+    /**
+     * Look up the interned key with the given contents.
+     * @return The shared key, or null if it was never interned.
+     */
+    Raw* find(const char* data, std::size_t length) const
+    {
+      return length > maxLength_ ? 0 : slots_[lookup(data, length)];
+    }
+
+    /**
+     * Equivalent to find(const char*, std::size_t) for C strings
+     */
+    Raw* find(const char* key) const
+    {
+      return find(key, strlen(key));
+    }
+
+    //! Number of keys interned
+    std::size_t size() const
+    {
+      return size_;
+    }
+
+    //! Longest key interned, in bytes
+    std::size_t maxLength() const
+    {
+      return maxLength_;
+    }
+
+    /**
+     * Delete all the interned keys. No Object unpacked with
+     * the cache may be in use anymore.
+     */
+    void clear()
+    {
+      for (std::size_t i = 0; i < slots_.size(); i++)
+      {
+        delete slots_[i];
+        slots_[i] = 0;
+      }
+      size_ = 0;
+    }
+
+  private:
+
+    KeyCache(const KeyCache&);
+    KeyCache& operator=(const KeyCache&);
+
+    //! Slot holding the given key, or the empty one where it belongs
+    std::size_t lookup(const char* data, std::size_t length) const
+    {
+      // FNV-1a
+      uint32_t hash = 2166136261u;
+      for (std::size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 16777619u;
+
+      std::size_t mask = slots_.size() - 1;
+      for (std::size_t i = hash & mask; ; i = (i + 1) & mask)
+      {
+        const Raw* key = slots_[i];
+        if (key == 0 || (key->size() == length &&
+            std::memcmp(key->getValue(), data, length) == 0))
+          return i;
+      }
+    }
+
+    std::vector<Raw*> slots_; //!< Open addressing table of keys
+    std::size_t capacity_;    //!< Maximum number of keys
+    std::size_t maxLength_;   //!< Longest key interned
+    std::size_t size_;        //!< Number of keys interned
+
+}; // KeyCache
+
+/**
+ * Exception likely to be thrown during the
+ * data deserialization.
+ */
+typedef std::ios_base::failure unpack_exception;
+
+namespace detail
+{
+
+/**
+ * Layout on the wire of an element, as described by its header
+ */
+struct element_layout
+{
+  object_type type;         //!< Type of the Object the element is unpacked into
+  std::size_t size;         //!< Size of the header and fixed length payload
+  std::size_t lengthBytes;  //!< Size of the length prefix after the header
+  uint32_t length;          //!< Length given by the fix raw, array and map headers
+
+  explicit element_layout(uint8_t header) MSGPACK_THROW__(unpack_exception) :
+    type(NIL), size(1), lengthBytes(0), length(0)
+  {
+    if (header <= 127)
+    {
+      type = INT8;
+    }
+    else if (header >= bm::MP_NEGATIVE_FIXNUM)
+    {
+      type = INT32;
+    }
+    else if (((uint8_t)(header & 0xE0)) == bm::MP_FIXRAW)
+    {
+      type = RAW;
+      length = header - bm::MP_FIXRAW;
+    }
+    else if (((uint8_t)(header & 0xF0)) == bm::MP_FIXARRAY)
+    {
+      type = ARRAY;
+      length = header - bm::MP_FIXARRAY;
+    }
+    else if (((uint8_t)(header & 0xF0)) == bm::MP_FIXMAP)
+    {
+      type = MAP;
+      length = header - bm::MP_FIXMAP;
+    }
+    else
+    {
+      switch (header)
+      {
+        case bm::MP_NULL:
+          break;
+        case bm::MP_FALSE:
+        case bm::MP_TRUE:
+          type = BOOL;
+          break;
+        case bm::MP_UINT8:
+          type = UINT8;
+          size += 1;
+          break;
+        case bm::MP_INT8:
+          type = INT8;
+          size += 1;
+          break;
+        case bm::MP_UINT16:
+          type = UINT16;
+          size += 2;
+          break;
+        case bm::MP_INT16:
+          type = INT16;
+          size += 2;
+          break;
+        case bm::MP_FLOAT:
+          type = FLOAT;
+          size += 4;
+          break;
+        case bm::MP_UINT32:
+          type = UINT32;
+          size += 4;
+          break;
+        case bm::MP_INT32:
+          type = INT32;
+          size += 4;
+          break;
+        case bm::MP_DOUBLE:
+          type = DOUBLE;
+          size += 8;
+          break;
+        case bm::MP_UINT64:
+          type = UINT64;
+          size += 8;
+          break;
+        case bm::MP_INT64:
+          type = INT64;
+          size += 8;
+          break;
+        case bm::MP_RAW16:
+          type = RAW;
+          lengthBytes = 2;
+          break;
+        case bm::MP_RAW32:
+          type = RAW;
+          lengthBytes = 4;
+          break;
+        case bm::MP_ARRAY16:
+          type = ARRAY;
+          lengthBytes = 2;
+          break;
+        case bm::MP_ARRAY32:
+          type = ARRAY;
+          lengthBytes = 4;
+          break;
+        case bm::MP_MAP16:
+          type = MAP;
+          lengthBytes = 2;
+          break;
+        case bm::MP_MAP32:
+          type = MAP;
+          lengthBytes = 4;
+          break;
+        default:
+          throw unpack_exception("Invalid header in the input data");
+      }
+    }
+  }
+};
+
+} // namespace detail
+
+/**
+ * Stats struct. Figures about one or more MessagePack messages, see
+ * {@see StatsRecorder}.
+ */
+struct Stats
+{
+  enum { TYPES = MAP + 1 };
+
+  uint64_t messages;         //!< Number of top level messages
+  uint64_t bytes;            //!< Bytes taken by the messages
+  uint64_t values[TYPES];    //!< Number of elements of each object_type
+  uint64_t objects;          //!< Objects allocated while unpacking
+  std::size_t maxDepth;      //!< Deepest nesting of containers
+  std::size_t maxSize;       //!< Largest number of elements in a container
+
+  Stats()
+  {
+    reset();
+  }
+
+  //! Zero all the figures
+  void reset()
+  {
+    messages = bytes = objects = 0;
+    maxDepth = maxSize = 0;
+    std::fill(values, values + TYPES, uint64_t(0));
+  }
+
+  //! Add the figures of other messages
+  Stats& operator+=(const Stats& other)
+  {
+    messages += other.messages;
+    bytes += other.bytes;
+    objects += other.objects;
+    for (int i = 0; i < TYPES; i++)
+      values[i] += other.values[i];
+    maxDepth = std::max(maxDepth, other.maxDepth);
+    maxSize = std::max(maxSize, other.maxSize);
+    return *this;
+  }
+
+  /**
+   * Add the figures of the given encoded message, e.g. the output
+   * of a Packer. It must be well formed, or an unpack_exception
+   * is thrown.
+   * @param data Pointer to the message
+   * @param length Length of the message in bytes
+   */
+  void scan(const char* data, std::size_t length) MSGPACK_THROW__(unpack_exception)
+  {
+    messages++;
+    bytes += length;
+
+    // Elements left in each of the open containers
+    std::vector<uint64_t> open;
+    const char* end = data + length;
+    while (data != end)
+    {
+      detail::element_layout layout((uint8_t) *data);
+      std::size_t headerSize = layout.size + layout.lengthBytes;
+      if (std::size_t(end - data) < headerSize)
+        throw unpack_exception("Reached end of buffer while reading");
+
+      uint32_t size = layout.length;
+      if (layout.lengthBytes == 2)
+        size = detail::load_network<uint16_t>(data + 1);
+      else if (layout.lengthBytes == 4)
+        size = detail::load_network<uint32_t>(data + 1);
+      data += headerSize;
+
+      values[layout.type]++;
+      if (!open.empty())
+        open.back()--;
+
+      if (layout.type == RAW)
+      {
+        if (std::size_t(end - data) < size)
+          throw unpack_exception("Reached end of buffer while reading");
+        data += size;
+      }
+      else if (layout.type == ARRAY || layout.type == MAP)
+      {
+        maxDepth = std::max(maxDepth, open.size() + 1);
+        maxSize = std::max(maxSize, std::size_t(size));
+        uint64_t count = layout.type == MAP ? 2 * uint64_t(size) : size;
+        if (count > 0)
+          open.push_back(count);
+      }
+
+      while (!open.empty() && open.back() == 0)
+        open.pop_back();
+    }
+  }
+};
+
+/**
+ * StatsRecorder class. Collects the {@see Stats} of every top level
+ * message an Unpacker decodes, when built with MSGPACK_STATS defined,
+ * see {@see Unpacker::setStats()}. Outgoing messages can be recorded
+ * as well with record(const char*, std::size_t).
+ * Subclasses can override onBegin() and onMessage() to export the
+ * figures, e.g. timing the messages or logging the largest ones.
+ */
+class StatsRecorder
+{
+  public:
+
+    virtual ~StatsRecorder() {}
+
+    //! Figures of all the messages recorded
+    const Stats& total() const
+    {
+      return total_;
+    }
+
+    //! Forget about the messages recorded
+    void reset()
+    {
+      total_.reset();
+    }
+
+    //! Record the figures of a message
+    void record(const Stats& message)
+    {
+      total_ += message;
+      onMessage(message);
+    }
+
+    //! Record an encoded message, see {@see Stats::scan()}
+    void record(const char* data, std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      Stats message;
+      message.scan(data, length);
+      record(message);
+    }
+
+  protected:
+
+    //! Called right before a message starts to be unpacked
+    virtual void onBegin() {}
+
+    //! Called with the figures of every message recorded
+    virtual void onMessage(const Stats&) {}
+
+  private:
+
+    Stats total_;  //!< Figures of all the messages
+
+    friend class Unpacker;
+};
+
+#ifdef MSGPACK_STATS
+#define MSGPACK_STATS_SCOPE__ StatsScope statsScope__(*this);
+#define MSGPACK_STATS_END__ statsScope__.end();
+#else
+#define MSGPACK_STATS_SCOPE__
+#define MSGPACK_STATS_END__
+#endif
+
+/**
+ * Unpacker class. Allows to deserialize MessagePack binary data
+ * from a stream
+ */
+class Unpacker
+{
+  public:
+
+    /**
+     * Constructor
+     * @param in Unpacker input stream from where the binary data is taken
+     */
+    Unpacker(std::istream& in) :
+      in_(&in), cur_(0), end_(0), zeroCopy_(false), arena_(0), keys_(0), elements_(0) {}
+
+    /**
+     * Constructor for unpacking directly from a memory region,
+     * which must outlive the Unpacker.
+     * @param data Pointer to the memory region
+     * @param length Length of the memory region in bytes
+     * @param zeroCopy If true, unpacked Raw objects will not copy their
+     * data but reference it in the memory region, so it must also
+     * outlive them.
+     */
+    Unpacker(const char* data, std::size_t length, bool zeroCopy = false) :
+      in_(0), cur_(data), end_(data + length), zeroCopy_(zeroCopy), arena_(0), keys_(0), elements_(0) {}
+
+    /**
+     * Set the cache where the short RAW keys of the unpacked maps
+     * are interned, so that repeated keys are shared instead of
+     * allocated again. The cache must outlive all the Objects
+     * unpacked from then on. Null disables interning.
+     */
+    void setKeyCache(KeyCache* cache)
+    {
+      keys_ = cache;
+    }
+
+    //! The cache where map keys are interned, if any
+    KeyCache* getKeyCache() const
+    {
+      return keys_;
+    }
+
+#ifdef MSGPACK_STATS
+    /**
+     * Set the recorder of the {@see Stats} of the top level messages
+     * unpacked from then on, with unpack() or skip(). Only available
+     * when built with MSGPACK_STATS defined, so that it costs nothing
+     * otherwise. Null disables the recording.
+     */
+    void setStats(StatsRecorder* recorder)
+    {
+      stats_.recorder = recorder;
+    }
+
+    //! The recorder of the Stats of the messages, if any
+    StatsRecorder* getStats() const
+    {
+      return stats_.recorder;
+    }
+#endif
+
+    /**
+     * This method allows to unpack an object of any type
+     * which implements the Parcelable interface.
+     * @param p Reference to an object to be unpacked
+     */
+    Unpacker& unpack(Parcelable& p)
+    {
+      MSGPACK_STATS_SCOPE__
+      p.unpack(*this);
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * This method allows to unpack an object of the given data
+     * type T. Should the data of the next element of the stream
+     * be from a different type or the stream be empty, and
+     * unpack_exception will be thrown.
+     * Scalar values are decoded straight into v, without building
+     * any intermediate Object.
+     * @param v Reference to the object to be populated with the
+     * unpacked data.
+     */
+    template<typename T>
+    Unpacker& unpack(T& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      unpackItem(v, detail::int_tag<detail::user_type<T>::value>());
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Read the header of the next element, which is expected to be
+     * an ARRAY, returning its size. The elements must be unpacked
+     * right after it. Nil and any other type throw an unpack_exception,
+     * the latter after being consumed.
+     */
+    std::size_t unpackArrayHeader() MSGPACK_THROW__(unpack_exception)
+    {
+      return unpackContainerHeader(bm::MP_FIXARRAY, bm::MP_ARRAY16, bm::MP_ARRAY32);
+    }
+
+    /**
+     * Read the header of the next element, which is expected to be
+     * a MAP, returning its size. The pairs of key and value must be
+     * unpacked right after it. Nil and any other type throw an
+     * unpack_exception, the latter after being consumed.
+     */
+    std::size_t unpackMapHeader() MSGPACK_THROW__(unpack_exception)
+    {
+      return unpackContainerHeader(bm::MP_FIXMAP, bm::MP_MAP16, bm::MP_MAP32);
+    }
+
+    /**
+     * Number of bytes left to unpack from the memory region.
+     * Always zero when unpacking from a stream.
+     */
+    std::size_t remaining() const
+    {
+      return end_ - cur_;
+    }
+
+    /**
+     * Consume the next element without building it. The elements of
+     * arrays and maps are skipped as well, and raw data is jumped over
+     * instead of being copied.
+     */
+    Unpacker& skip() MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      skipElements(1);
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Look for the given key in the next element, which is expected to
+     * be a MAP, leaving the Unpacker positioned on its value. The
+     * entries before it are skipped, and those after the value are
+     * left to be consumed by the caller.
+     * If the key is not found, the whole map is consumed.
+     * @param key Pointer to the key data
+     * @param length Length of the key in bytes
+     * @return true if the key was found
+     */
+    bool seek(const char* key, std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      std::size_t size = unpackMapHeader();
+      for(std::size_t i = 0; i < size; i++)
+      {
+        if(eof())
+          throw unpack_exception("Reached end of stream");
+
+        // Only RAW keys are compared, any other is skipped with its value
+        uint8_t header;
+        read(header);
+        detail::element_layout layout(header);
+        uint32_t keySize = readLength(layout);
+        if(layout.type == RAW)
+        {
+          if(matchRaw(keySize, key, length))
+            return true;
+        }
+        else
+        {
+          skipElements(skipPayload(layout, keySize));
+        }
+        skip();
+      }
+      return false;
+    }
+
+    /**
+     * Look for the given string key in the next element, which is
+     * expected to be a MAP. See {@see seek(const char*, std::size_t)}.
+     */
+    template<typename char_t>
+    bool seek(const std::basic_string<char_t>& key) MSGPACK_THROW__(unpack_exception)
+    {
+      return seek((const char*) key.data(), key.size() * sizeof(char_t));
+    }
+
+    /**
+     * Look for the given null terminated key in the next element, which
+     * is expected to be a MAP. See {@see seek(const char*, std::size_t)}.
+     */
+    bool seek(const char* key) MSGPACK_THROW__(unpack_exception)
+    {
+      return seek(key, strlen(key));
+    }
+
+  private:
+
+    /**
+     * Consume raw data of the given size, returning true if it matches
+     * the given key
+     */
+    bool matchRaw(std::size_t size, const char* key, std::size_t length)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      if(size != length)
+      {
+        discard(size);
+        return false;
+      }
+
+      if(std::size_t(end_ - cur_) >= size)
+      {
+        bool match = std::memcmp(cur_, key, size) == 0;
+        cur_ += size;
+        return match;
+      }
+
+      bool match = true;
+      char chunk[64];
+      while(size > 0)
+      {
+        std::size_t n = size < sizeof(chunk) ? size : sizeof(chunk);
+        read(chunk, n);
+        match = match && std::memcmp(chunk, key, n) == 0;
+        key += n;
+        size -= n;
+      }
+      return match;
+    }
+
+    //! Consume the given number of elements without building them
+    void skipElements(uint64_t pending) MSGPACK_THROW__(unpack_exception)
+    {
+      // Number of elements left, including those of nested containers
+      while(pending > 0)
+      {
+        if(eof())
+          throw unpack_exception("Reached end of stream");
+
+        uint8_t header;
+        read(header);
+        pending--;
+
+        detail::element_layout layout(header);
+        pending += skipPayload(layout, readLength(layout));
+      }
+    }
+
+    //! Read the length prefix following the header of an element
+    uint32_t readLength(const detail::element_layout& layout) MSGPACK_THROW__(unpack_exception)
+    {
+      uint32_t length = layout.length;
+      if(layout.lengthBytes == 2)
+      {
+        uint16_t uint16Val;
+        read(uint16Val);
+        length = uint16Val;
+      }
+      else if(layout.lengthBytes == 4)
+      {
+        read(length);
+      }
+      return length;
+    }
+
+    /**
+     * Jump over the payload of an element whose header and length
+     * prefix were read. Returns the number of nested elements of
+     * arrays and maps, which are still to be skipped.
+     */
+    uint64_t skipPayload(const detail::element_layout& layout, uint32_t length)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      if(layout.type == ARRAY)
+        return length;
+      if(layout.type == MAP)
+        return uint64_t(length) * 2;
+
+      discard(layout.type == RAW ? length : layout.size - 1);
+      return 0;
+    }
+
+    //! Unpack a type handled by the generic unpack method
+    template<typename T> inline
+    Unpacker& unpackItem(T& v, detail::int_tag<detail::FIELDS_TYPE>) MSGPACK_THROW__(unpack_exception)
+    {
+      v.msgpack_unpack(*this);
+      return *this;
+    }
+
+    template<typename T> inline
+    Unpacker& unpackItem(T& v, detail::int_tag<detail::PARCELABLE_TYPE>) MSGPACK_THROW__(unpack_exception)
+    {
+      return unpack((Parcelable&) v);
+    }
+
+    template<typename T>
+    Unpacker& unpackItem(T& v, detail::int_tag<detail::NO_USER_TYPE>) MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      uint8_t header;
+      read(header); // Read the header
+
+      if(header == bm::MP_NULL)
+        throw unpack_exception("Null retrieved from the input stream");
+
+      if(!unpackScalar(header, v))
+      {
+        // Not a scalar, consume the whole element leaving v untouched
+        Object* obj = unpackObject(header);
+        if(obj == 0)
+          throw unpack_exception("Unable to get next object from stream");
+        delete obj;
+
+        // The elements of an STL container must all be decoded
+        if(elements_ > 0)
+          throw unpack_exception("Element type does not match the container");
+      }
+
+      return *this;
+    }
+
+  public:
+
+    /**
+     * This method allows unpacking a generic C++ string.
+     * Should the next element of the stream not be a string of the provided
+     * type or a different object, or the stream be null, an unpack_exception
+     * will be thrown.
+     * @param v Reference to the string to be populated.
+     */
+    template<typename char_t>
+    Unpacker& unpack(std::basic_string<char_t>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      uint32_t size = 0;
+      if(!unpackRawHeader(size))
+        throw unpack_exception("Unable to get next object from stream");
+
+      std::size_t count = size / sizeof(char_t);
+      if(std::size_t(end_ - cur_) >= std::size_t(size))
+      {
+        v.assign((const char_t*) cur_, count);
+        cur_ += size;
+      }
+      else
+      {
+        v.resize(count);
+        if(count > 0)
+          read((char*) &v[0], count * sizeof(char_t));
+        discard(size - count * sizeof(char_t));
+      }
+
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * This method allows unpacking a reference to the data of the next
+     * RAW element, which must be available in the Unpacker memory region.
+     * Should the next element not be a RAW, or the Unpacker be reading
+     * from a stream, an unpack_exception will be thrown.
+     * @param v Reference to be pointed to the element data.
+     */
+    Unpacker& unpack(RawRef& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      if(in_ != 0)
+        throw unpack_exception("Raw references require a memory region");
+
+      uint32_t size = 0;
+      if(!unpackRawHeader(size))
+        throw unpack_exception("Unable to get next object from stream");
+
+      if(std::size_t(end_ - cur_) < size)
+        throw unpack_exception("Reached end of buffer while reading");
+
+      v = RawRef(cur_, size);
+      cur_ += size;
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack an array into a std::vector. Should the next element of the
+     * stream not be an array, or any of its elements not be of the
+     * type T, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T>
+    Unpacker& unpack(std::vector<T>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackArrayHeader();
+      ElementScope scope(*this);
+      v.clear();
+      v.reserve(reserveHint(size));
+      for (std::size_t i = 0; i < size;)
+      {
+        // Runs of elements sharing the same wire type are decoded at once
+        i += unpackRun(v, size - i);
+        if (i < size)
+        {
+          unpackBack(v);
+          i++;
+        }
+      }
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack an array into a std::deque. Should the next element of the
+     * stream not be an array, or any of its elements not be of the
+     * type T, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T>
+    Unpacker& unpack(std::deque<T>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackArrayHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+        unpackBack(v);
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack an array into a std::list. Should the next element of the
+     * stream not be an array, or any of its elements not be of the
+     * type T, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T>
+    Unpacker& unpack(std::list<T>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackArrayHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+        unpackBack(v);
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack an array into a std::set. Should the next element of the
+     * stream not be an array, or any of its elements not be of the
+     * type T, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T>
+    Unpacker& unpack(std::set<T>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackArrayHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+      {
+        T item = T();
+        unpack(item);
+        v.insert(item);
+      }
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack an array into a std::multiset. Should the next element of the
+     * stream not be an array, or any of its elements not be of the
+     * type T, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T>
+    Unpacker& unpack(std::multiset<T>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackArrayHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+      {
+        T item = T();
+        unpack(item);
+        v.insert(item);
+      }
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack a map into a std::map. Should the next element of the
+     * stream not be a map, or any of its keys and values not be of the
+     * types T and U, an unpack_exception will be thrown. Later entries
+     * override earlier ones with the same key.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T, typename U>
+    Unpacker& unpack(std::map<T, U>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackMapHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+      {
+        T key = T();
+        unpack(key);
+        unpack(v[key]);
+      }
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Unpack a map into a std::multimap. Should the next element of the
+     * stream not be a map, or any of its keys and values not be of the
+     * types T and U, an unpack_exception will be thrown.
+     * @param v Reference to the container to be populated.
+     */
+    template<typename T, typename U>
+    Unpacker& unpack(std::multimap<T, U>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      MSGPACK_STATS_SCOPE__
+      std::size_t size = unpackMapHeader();
+      ElementScope scope(*this);
+      v.clear();
+      for (std::size_t i = 0; i < size; i++)
+      {
+        T key = T();
+        unpack(key);
+        unpack(v.insert(std::make_pair(key, U()))->second);
+      }
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+    /**
+     * Equivalent to unpack(T&)
+     */
+    template<typename T>
+    Unpacker& operator>>(T& v) MSGPACK_THROW__(unpack_exception)
+    {
+      return unpack(v);
+    }
+
+    /**
+     * Equivalent to unpack(std::basic_string<char_t>&)
+     */
+    template<typename char_t>
+    Unpacker& operator>>(std::basic_string<char_t>& v) MSGPACK_THROW__(unpack_exception)
+    {
+      return unpack(v);
+    }
+
+    /**
+     * Equivalent to unpack(Parcelable&)
+     */
+    Unpacker& operator>>(Parcelable& v) MSGPACK_THROW__(unpack_exception)
+    {
+      return unpack(v);
+    }
+
+    /**
+     * Builds an Object from the available data in the input
+     * stream. The caller is responsible for deleting the returned
+     * instance.
+     * This method may throw an {@see unpack_exception} in case the
+     * buffer runs out of data while trying to deserialize.
+     */
+    Object* unpack() MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      MSGPACK_STATS_SCOPE__
+      uint8_t value;
+      read(value); // Read the header
+
+      Object* ret = unpackObject(value);
+      MSGPACK_STATS_END__
+      return ret;
+    }
+
+    /**
+     * Builds an Object from the available data in the input stream,
+     * allocating it and all its children in the given Arena. The
+     * returned instance must not be deleted, it will be released
+     * along with the rest of the Arena memory on Arena::reset().
+     * This method may throw an {@see unpack_exception} in case the
+     * buffer runs out of data while trying to deserialize.
+     * @param arena Arena where the Objects are allocated.
+     */
+    Object* unpack(Arena& arena) MSGPACK_THROW__(unpack_exception)
+    {
+      ArenaScope scope(arena_, arena);
+      return unpack();
+    }
+
+    /**
+     * Unpacks the next element of the input stream into a compact
+     * {@see Value}. The elements of arrays and maps, and the data of
+     * raws, are allocated in the given Arena, unless the Unpacker
+     * references them in its memory region. They are all released
+     * at once on Arena::reset().
+     * This method may throw an {@see unpack_exception} in case the
+     * buffer runs out of data while trying to deserialize.
+     * @param v Value to be populated with the unpacked data.
+     * @param arena Arena where the elements are allocated.
+     */
+    Unpacker& unpack(Value& v, Arena& arena) MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      MSGPACK_STATS_SCOPE__
+      unpackValue(v, arena);
+      MSGPACK_STATS_END__
+      return *this;
+    }
+
+  private:
+
+    //! Sets the Arena used by the Unpacker during its lifetime
+    struct ArenaScope
+    {
+      ArenaScope(Arena*& slot, Arena& arena) : slot_(slot), prev_(slot) { slot_ = &arena; }
+      ~ArenaScope() { slot_ = prev_; }
+
+      Arena*& slot_;
+      Arena* prev_;
+    };
+
+    //! Create a new Object, in the Arena if there's one
+    template<typename T> inline
+    T* create()
+    {
+#ifdef MSGPACK_STATS
+      stats_.objects++;
+#endif
+      return arena_ ? new (arena_->allocate(sizeof(T))) T() : new T();
+    }
+
+    template<typename T, typename A> inline
+    T* create(const A& a)
+    {
+#ifdef MSGPACK_STATS
+      stats_.objects++;
+#endif
+      return arena_ ? new (arena_->allocate(sizeof(T))) T(a) : new T(a);
+    }
+
+    template<typename T, typename A, typename B, typename C> inline
+    T* create(const A& a, const B& b, const C& c)
+    {
+#ifdef MSGPACK_STATS
+      stats_.objects++;
+#endif
+      return arena_ ? new (arena_->allocate(sizeof(T))) T(a, b, c) : new T(a, b, c);
+    }
+
+    //! Build an Object from the data following the given header
+    Object* unpackObject(uint8_t value) MSGPACK_THROW__(unpack_exception)
+    {
+      using namespace detail;
+
+      type_traits<FLOAT>::type  fVal;
+      type_traits<DOUBLE>::type dVal;
+      type_traits<INT8>::type   int8Val;
+      type_traits<INT16>::type  int16Val;
+      type_traits<INT32>::type int32Val;
+      type_traits<INT64>::type int64Val;
+      type_traits<UINT8>::type uint8Val;
+      type_traits<UINT16>::type uint16Val;
+      type_traits<UINT32>::type uint32Val;
+      type_traits<UINT64>::type uint64Val;
+
+      // Compilers turn this switch into a jump table already: a 256
+      // entry table of header kinds measured up to 14% slower
+      switch (value)
+      {
+        case bm::MP_NULL:
+          return create<Nil>();
+        case bm::MP_FALSE:
+          return create<Bool>(false);
+        case bm::MP_TRUE:
+          return create<Bool>(true);
+        case bm::MP_FLOAT:
+          read(fVal);
+          return create<Float>(fVal);
+        case bm::MP_DOUBLE:
+          read(dVal);
+          return create<Double>(dVal);
+        case bm::MP_UINT8:
+          read(uint8Val);
+          return create<UInt8>(uint8Val);
+        case bm::MP_UINT16:
+          read(uint16Val);
+          return create<UInt16>(uint16Val);
+        case bm::MP_UINT32:
+          read(uint32Val);
+          return create<UInt32>(uint32Val);
+        case bm::MP_UINT64:
+          read(uint64Val);
+          return create<UInt64>(uint64Val);
+        case bm::MP_INT8:
+          read(int8Val);
+          return create<Int8>(int8Val);
+        case bm::MP_INT16:
+          read(int16Val);
+          return create<Int16>(int16Val);
+        case bm::MP_INT32:
+          read(int32Val);
+          return create<Int32>(int32Val);
+        case bm::MP_INT64:
+          read(int64Val);
+          return create<Int64>(int64Val);
+        case bm::MP_ARRAY16:
+          read(uint16Val);
+          return unpackArray(uint16Val);
+        case bm::MP_ARRAY32:
+          read(uint32Val);
+          return unpackArray(uint32Val);
+        case bm::MP_MAP16:
+          read(uint16Val);
+          return unpackMap(uint16Val);
+        case bm::MP_MAP32:
+          read(uint32Val);
+          return unpackMap(uint32Val);
+        case bm::MP_RAW16:
+          read(uint16Val);
+          return unpackRaw(uint16Val);
+        case bm::MP_RAW32:
+          read(uint32Val);
+          return unpackRaw(uint32Val);
+      }
+
+      if (((uint8_t)(value & 0xE0)) == bm::MP_FIXRAW)
+      {
+        return unpackRaw(value - bm::MP_FIXRAW);
+      }
+
+      if (((uint8_t)(value & 0xE0)) == bm::MP_NEGATIVE_FIXNUM)
+      {
+        return create<Int32>((value & 0x1F) - 32);
+      }
+
+      if (((uint8_t)(value & 0xF0)) == bm::MP_FIXARRAY)
+      {
+        return unpackArray(value - bm::MP_FIXARRAY);
+      }
+
+      if (((uint8_t)(value & 0xF0)) == bm::MP_FIXMAP)
+      {
+        return unpackMap(value - bm::MP_FIXMAP);
+      }
+
+      if (value <= 127) //MP_FIXNUM
+      {
+        return create<Int8>(value);
+      }
+      else
+      {
+        return 0;
+      }
+    }
+
+    //! Read the header of the next container of the given kind
+    std::size_t unpackContainerHeader(uint8_t fix, uint8_t header16, uint8_t header32)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      uint8_t header;
+      read(header);
+
+      uint16_t uint16Val;
+      uint32_t uint32Val;
+
+      if(((uint8_t)(header & 0xF0)) == fix)
+        return header - fix;
+
+      if(header == header16)
+      {
+        read(uint16Val);
+        return uint16Val;
+      }
+
+      if(header == header32)
+      {
+        read(uint32Val);
+        return uint32Val;
+      }
+
+      if(header == bm::MP_NULL)
+        throw unpack_exception("Null retrieved from the input stream");
+
+      delete unpackObject(header);
+      throw unpack_exception("Unable to get next object from stream");
+    }
+
+    //! Unpack a new element at the end of the given container
+    template<typename C> inline
+    void unpackBack(C& c) MSGPACK_THROW__(unpack_exception)
+    {
+      c.push_back(typename C::value_type());
+      unpack(c.back());
+    }
+
+    inline void unpackBack(std::vector<bool>& c) MSGPACK_THROW__(unpack_exception)
+    {
+      bool item = false;
+      unpack(item);
+      c.push_back(item);
+    }
+
+    /**
+     * Decode at once the longest run of the following elements which
+     * share the same wire type, when available in the memory region.
+     * Returns the number of elements decoded.
+     */
+    template<typename C> inline
+    std::size_t unpackRun(C&, std::size_t)
+    {
+      return 0;
+    }
+
+    template<typename T> inline
+    std::size_t unpackRun(std::vector<T>& v, std::size_t length)
+    {
+      return unpackFixnumRun(v, length, detail::int_tag<detail::is_bulk<T>::value>());
+    }
+
+    inline std::size_t unpackRun(std::vector<float>& v, std::size_t length)
+    {
+      return unpackFixedRun(v, length, bm::MP_FLOAT);
+    }
+
+    inline std::size_t unpackRun(std::vector<double>& v, std::size_t length)
+    {
+      return unpackFixedRun(v, length, bm::MP_DOUBLE);
+    }
+
+    template<typename T> inline
+    std::size_t unpackFixnumRun(std::vector<T>&, std::size_t, detail::int_tag<0>)
+    {
+      return 0;
+    }
+
+    //! Decode a run of positive and negative fixnums
+    template<typename T>
+    std::size_t unpackFixnumRun(std::vector<T>& v, std::size_t length, detail::int_tag<1>)
+    {
+      std::size_t avail = end_ - cur_;
+      std::size_t n = length < avail ? length : avail;
+
+      std::size_t run = 0;
+      while (run < n && ((uint8_t) cur_[run] <= 127 || (uint8_t) cur_[run] >= bm::MP_NEGATIVE_FIXNUM))
+        run++;
+
+      std::size_t pos = v.size();
+      v.resize(pos + run);
+      for (std::size_t i = 0; i < run; i++)
+        v[pos + i] = (T) (int8_t) cur_[i];
+
+      cur_ += run;
+      return run;
+    }
+
+    //! Decode a run of elements with the given fixed length header
+    template<typename T>
+    std::size_t unpackFixedRun(std::vector<T>& v, std::size_t length, uint8_t header)
+    {
+      const std::size_t stride = 1 + sizeof(T);
+      std::size_t avail = (end_ - cur_) / stride;
+      std::size_t n = length < avail ? length : avail;
+
+      std::size_t run = 0;
+      while (run < n && (uint8_t) cur_[run * stride] == header)
+        run++;
+
+      std::size_t pos = v.size();
+      v.resize(pos + run);
+      if (run > 0)
+        decodeRun(&v[pos], cur_, run);
+
+      cur_ += run * stride;
+      return run;
+    }
+
+    /**
+     * Decode a run of MP_FLOAT elements whose headers were checked.
+     * With SSSE3 the bytes of four values at a time are swapped with
+     * a single shuffle.
+     */
+    static void decodeRun(float* out, const char* p, std::size_t length)
+    {
+      std::size_t i = 0;
+#ifdef MSGPACK_SSSE3__
+      for (; length - i >= 4; i += 4)
+        detail::decode_floats(out + i, p + i * 5);
+#endif
+      for (; i < length; i++)
+        out[i] = detail::load_network<float>(p + i * 5 + 1);
+    }
+
+    /**
+     * Decode a run of MP_DOUBLE elements. A shuffle of two values at
+     * a time measured slower than a byte swap instruction for each.
+     */
+    static void decodeRun(double* out, const char* p, std::size_t length)
+    {
+      for (std::size_t i = 0; i < length; i++)
+        out[i] = detail::load_network<double>(p + i * 9 + 1);
+    }
+
+    /**
+     * Read the header of the next element, which is expected to be
+     * a RAW, and its length. Nil elements throw, and any other type
+     * is consumed returning false.
+     */
+    bool unpackRawHeader(uint32_t& size) MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      uint8_t header;
+      read(header);
+
+      uint16_t uint16Val;
+
+      if(header == bm::MP_NULL)
+      {
+        throw unpack_exception("Null retrieved from the input stream");
+      }
+      else if(header == bm::MP_RAW16)
+      {
+        read(uint16Val);
+        size = uint16Val;
+      }
+      else if(header == bm::MP_RAW32)
+      {
+        read(size);
+      }
+      else if(((uint8_t)(header & 0xE0)) == bm::MP_FIXRAW)
+      {
+        size = header - bm::MP_FIXRAW;
+      }
+      else
+      {
+        delete unpackObject(header);
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * Decode the scalar element identified by the given header
+     * straight into v, with no intermediate Object.
+     * Returns false if the header does not belong to a scalar type.
+     */
+    template<typename T>
+    bool unpackScalar(uint8_t value, T& v) MSGPACK_THROW__(unpack_exception)
+    {
+      using namespace detail;
+
+      if (value <= 127) //MP_FIXNUM
+      {
+        v = (T) (type_traits<INT8>::type) value;
+        return true;
+      }
+
+      if (((uint8_t)(value & 0xE0)) == bm::MP_NEGATIVE_FIXNUM)
+      {
+        v = (T) (type_traits<INT32>::type) ((value & 0x1F) - 32);
+        return true;
+      }
+
+      switch (value)
+      {
+        case bm::MP_FALSE:
+          v = (T) false;
+          return true;
+        case bm::MP_TRUE:
+          v = (T) true;
+          return true;
+        case bm::MP_FLOAT:
+          return readAs<type_traits<FLOAT>::type>(v);
+        case bm::MP_DOUBLE:
+          return readAs<type_traits<DOUBLE>::type>(v);
+        case bm::MP_UINT8:
+          return readAs<type_traits<UINT8>::type>(v);
+        case bm::MP_UINT16:
+          return readAs<type_traits<UINT16>::type>(v);
+        case bm::MP_UINT32:
+          return readAs<type_traits<UINT32>::type>(v);
+        case bm::MP_UINT64:
+          return readAs<type_traits<UINT64>::type>(v);
+        case bm::MP_INT8:
+          return readAs<type_traits<INT8>::type>(v);
+        case bm::MP_INT16:
+          return readAs<type_traits<INT16>::type>(v);
+        case bm::MP_INT32:
+          return readAs<type_traits<INT32>::type>(v);
+        case bm::MP_INT64:
+          return readAs<type_traits<INT64>::type>(v);
+      }
+
+      return false;
+    }
+
+    //! Read a wire value of type W and convert it into v
+    template<typename W, typename T> inline
+    bool readAs(T& v) MSGPACK_THROW__(unpack_exception)
+    {
+      W w;
+      read(w);
+      v = (T) w;
+      return true;
+    }
+
+    //! Unpack an array
+    Array* unpackArray(uint32_t size)
+    {
+      Array* ret = create<Array>(arena_);
+      ObjectScope scope(ret, arena_);
+      ret->reserve(reserveHint(size));
+      for (uint32_t i = 0; i < size; ++i)
+      {
+        ret->add(unpack());
+      }
+      scope.release();
+      return ret;
+    }
+
+    //! Unpack a map
+    Map* unpackMap(uint32_t size)
+    {
+      Map* ret = create<Map>(arena_);
+      ObjectScope scope(ret, arena_);
+      ret->reserve(reserveHint(size));
+
+      for (uint32_t i = 0; i < size; ++i)
+      {
+        Object* key = keys_ ? unpackKey() : unpack();
+        ObjectScope keyScope(key, arena_);
+        Object* val = unpack();
+        keyScope.release();
+        ret->insert(key, val);
+      }
+      scope.release();
+      return ret;
+    }
+
+
+    //! Unpack a map key, interning it if it is a short RAW
+    Object* unpackKey() MSGPACK_THROW__(unpack_exception)
+    {
+      if(eof())
+        throw unpack_exception("Reached end of stream");
+
+      uint8_t value;
+      read(value);
+
+      std::size_t size = value & 0x1f;
+      if ((value & 0xe0) != bm::MP_FIXRAW || size > keys_->maxLength())
+        return unpackObject(value);
+
+      char buffer[32];
+      const char* data = buffer;
+      if (cur_ != 0 && std::size_t(end_ - cur_) >= size)
+      {
+        data = cur_;
+        cur_ += size;
+      }
+      else if (in_ == 0)
+        throw unpack_exception("Reached end of buffer while reading");
+      else
+        read(buffer, size);
+
+      Object* key = keys_->intern(data, size);
+      return key ? key : copyRaw(data, size, data != buffer);
+    }
+
+    //! Build a Raw from data already read
+    Raw* copyRaw(const char* data, std::size_t size, bool inRegion)
+    {
+      typedef detail::type_traits<RAW>::type raw_type;
+      typedef detail::remove_pointer<raw_type>::type byte_type;
+
+      if (zeroCopy_ && inRegion)
+        return create<Raw>((raw_type) data, size, false);
+
+      if (arena_ != 0)
+      {
+        raw_type copy = (raw_type) arena_->allocate(size);
+        std::memcpy(copy, data, size);
+        return create<Raw>(copy, size, false);
+      }
+
+      raw_type copy = new byte_type[size];
+      std::memcpy(copy, data, size);
+      return create<Raw>(copy, size, true);
+    }
+
+    //! Unpack raw data
+    Raw* unpackRaw(uint32_t size)
+    {
+      if (in_ == 0 && std::size_t(end_ - cur_) < size)
+        throw unpack_exception("Reached end of buffer while reading");
+
+      typedef detail::type_traits<RAW>::type raw_type;
+      typedef detail::remove_pointer<raw_type>::type byte_type;
+
+      if (zeroCopy_ && std::size_t(end_ - cur_) >= std::size_t(size))
+      {
+        raw_type data = (raw_type) cur_;
+        cur_ += size;
+        return create<Raw>(data, size, false);
+      }
+
+      if (arena_ != 0)
+      {
+        raw_type data = (raw_type) arena_->allocate(size);
+        read((char*) data, size);
+        return create<Raw>(data, size, false);
+      }
+
+      raw_type data = new byte_type[size];
+      try
+      {
+        read((char*) data, size);
+      }
+      catch(...)
+      {
+        delete[] data;
+        throw;
+      }
+
+      return create<Raw>(data, size, true);
+    }
+
+    //! Unpack the next element into a Value
+    void unpackValue(Value& v, Arena& arena) MSGPACK_THROW__(unpack_exception)
+    {
+      uint8_t header;
+      read(header);
+
+      if (header <= 127) //MP_FIXNUM
+      {
+        setValue(v, INT8, (int64_t) header);
+        return;
+      }
+
+      if (((uint8_t)(header & 0xE0)) == bm::MP_NEGATIVE_FIXNUM)
+      {
+        setValue(v, INT32, (int64_t) ((header & 0x1F) - 32));
+        return;
+      }
+
+      if (((uint8_t)(header & 0xE0)) == bm::MP_FIXRAW)
+      {
+        unpackValueRaw(v, header - bm::MP_FIXRAW, arena);
+        return;
+      }
+
+      if (((uint8_t)(header & 0xF0)) == bm::MP_FIXARRAY)
+      {
+        unpackValueContainer(v, ARRAY, header - bm::MP_FIXARRAY, arena);
+        return;
+      }
+
+      if (((uint8_t)(header & 0xF0)) == bm::MP_FIXMAP)
+      {
+        unpackValueContainer(v, MAP, header - bm::MP_FIXMAP, arena);
+        return;
+      }
+
+      int8_t int8Val;
+      int16_t int16Val;
+      int32_t int32Val;
+      int64_t int64Val;
+      uint8_t uint8Val;
+      uint16_t uint16Val;
+      uint32_t uint32Val;
+      uint64_t uint64Val;
+
+      v.size_ = 0;
+      switch (header)
+      {
+        case bm::MP_NULL:
+          v.type_ = NIL;
+          v.u_.uint64Val = 0;
+          return;
+        case bm::MP_FALSE:
+        case bm::MP_TRUE:
+          v.type_ = BOOL;
+          v.u_.uint64Val = 0;
+          v.u_.boolVal = (header == bm::MP_TRUE);
+          return;
+        case bm::MP_FLOAT:
+          v.type_ = FLOAT;
+          v.u_.uint64Val = 0;
+          read(v.u_.floatVal);
+          return;
+        case bm::MP_DOUBLE:
+          v.type_ = DOUBLE;
+          read(v.u_.doubleVal);
+          return;
+        case bm::MP_UINT8:
+          read(uint8Val);
+          setValue(v, UINT8, (uint64_t) uint8Val);
+          return;
+        case bm::MP_UINT16:
+          read(uint16Val);
+          setValue(v, UINT16, (uint64_t) uint16Val);
+          return;
+        case bm::MP_UINT32:
+          read(uint32Val);
+          setValue(v, UINT32, (uint64_t) uint32Val);
+          return;
+        case bm::MP_UINT64:
+          read(uint64Val);
+          setValue(v, UINT64, uint64Val);
+          return;
+        case bm::MP_INT8:
+          read(int8Val);
+          setValue(v, INT8, (int64_t) int8Val);
+          return;
+        case bm::MP_INT16:
+          read(int16Val);
+          setValue(v, INT16, (int64_t) int16Val);
+          return;
+        case bm::MP_INT32:
+          read(int32Val);
+          setValue(v, INT32, (int64_t) int32Val);
+          return;
+        case bm::MP_INT64:
+          read(int64Val);
+          setValue(v, INT64, int64Val);
+          return;
+        case bm::MP_ARRAY16:
+          read(uint16Val);
+          unpackValueContainer(v, ARRAY, uint16Val, arena);
+          return;
+        case bm::MP_ARRAY32:
+          read(uint32Val);
+          unpackValueContainer(v, ARRAY, uint32Val, arena);
+          return;
+        case bm::MP_MAP16:
+          read(uint16Val);
+          unpackValueContainer(v, MAP, uint16Val, arena);
+          return;
+        case bm::MP_MAP32:
+          read(uint32Val);
+          unpackValueContainer(v, MAP, uint32Val, arena);
+          return;
+        case bm::MP_RAW16:
+          read(uint16Val);
+          unpackValueRaw(v, uint16Val, arena);
+          return;
+        case bm::MP_RAW32:
+          read(uint32Val);
+          unpackValueRaw(v, uint32Val, arena);
+          return;
+      }
+
+      throw unpack_exception("Unable to get next object from stream");
+    }
+
+    //! Set the contents of an integer Value
+    static void setValue(Value& v, object_type type, int64_t value)
+    {
+      v.type_ = type;
+      v.size_ = 0;
+      v.u_.int64Val = value;
+    }
+
+    static void setValue(Value& v, object_type type, uint64_t value)
+    {
+      v.type_ = type;
+      v.size_ = 0;
+      v.u_.uint64Val = value;
+    }
+
+    //! Unpack the data of a RAW Value
+    void unpackValueRaw(Value& v, uint32_t size, Arena& arena) MSGPACK_THROW__(unpack_exception)
+    {
+      v.type_ = RAW;
+      v.size_ = size;
+
+      if (zeroCopy_ && std::size_t(end_ - cur_) >= size)
+      {
+        v.u_.rawVal = cur_;
+        cur_ += size;
+        return;
+      }
+
+      if (in_ == 0 && std::size_t(end_ - cur_) < size)
+        throw unpack_exception("Reached end of buffer while reading");
+
+      char* data = (char*) arena.allocate(size);
+      read(data, size);
+      v.u_.rawVal = data;
+    }
+
+    //! Unpack the elements of an ARRAY or MAP Value
+    void unpackValueContainer(Value& v, object_type type, uint32_t size, Arena& arena)
+      MSGPACK_THROW__(unpack_exception)
+    {
+      std::size_t count = (type == MAP) ? 2 * std::size_t(size) : size;
+
+      // Every element takes at least one byte
+      if (in_ == 0 && std::size_t(end_ - cur_) < count)
+        throw unpack_exception("Reached end of buffer while reading");
+
+      Value* values = (Value*) arena.allocate(count * sizeof(Value));
+      for (std::size_t i = 0; i < count; i++)
+        unpackValue(*new (&values[i]) Value(), arena);
+
+      v.type_ = type;
+      v.size_ = size;
+      v.u_.values = values;
+    }
+
+    /**
+     * Number of elements worth reserving for a container of the
+     * given size, so that corrupted headers can not trigger
+     * huge allocations before any data has been read.
+     */
+    std::size_t reserveHint(std::size_t size) const
+    {
+      // Every element takes at least one byte
+      std::size_t bound = (in_ == 0) ? std::size_t(end_ - cur_) : bm::MAX_16BIT;
+      return size < bound ? size : bound;
+    }
+
+    //! Returns true if there's no data left to unpack
+    bool eof() const
+    {
+      return cur_ == end_ && (in_ == 0 || in_->eof());
+    }
+
+    //! Read an object of the given type from the underlying buffer
+    template<typename T> inline
+    Unpacker& read(T& ret) MSGPACK_THROW__(unpack_exception)
+    {
+      if (std::size_t(end_ - cur_) >= sizeof(T))
+      {
+        ret = detail::load_network<T>(cur_);
+        cur_ += sizeof(T);
+        return *this;
+      }
+
+      char buf[sizeof(T)];
+      underflow(buf, sizeof(T));
+      ret = detail::load_network<T>(buf);
+      return *this;
+    }
+
+    //! Read a memory area from the underlying buffer
+    inline Unpacker& read(char* data, std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      if(std::size_t(end_ - cur_) >= length)
+      {
+        std::memcpy(data, cur_, length);
+        cur_ += length;
+      }
+      else
+      {
+        underflow(data, length);
+      }
+      return *this;
+    }
+
+    //! Discard the given number of bytes from the underlying buffer
+    void discard(std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      if(std::size_t(end_ - cur_) >= length)
+      {
+        cur_ += length;
+        return;
+      }
+
+      if(in_ == 0 || in_->eof())
+        throw unpack_exception("Reached end of stream while reading");
+
+#ifdef MSGPACK_STATS
+      // Keep the bytes of the message being recorded
+      if(stats_.recording())
+      {
+        std::string& bytes = stats_.stream;
+        std::size_t offset = bytes.size();
+        bytes.resize(offset + length);
+        in_->read(&bytes[offset], length);
+        if(std::size_t(in_->gcount()) < length)
+          throw unpack_exception("Reached end of stream while reading");
+        return;
+      }
+#endif
+
+      in_->ignore(length);
+      if(std::size_t(in_->gcount()) < length)
+        throw unpack_exception("Reached end of stream while reading");
+    }
+
+    //! Called when the requested data is not in the buffer
+    void underflow(char* data, std::size_t length) MSGPACK_THROW__(unpack_exception)
+    {
+      if(in_ == 0 || in_->eof())
+        throw unpack_exception("Reached end of stream while reading");
+
+      in_->read(data, length);
+
+      if(std::size_t(in_->gcount()) < length)
+        throw unpack_exception("Reached end of stream while reading");
+
+#ifdef MSGPACK_STATS
+      if(stats_.recording())
+        stats_.stream.append(data, length);
+#endif
+    }
+
+    /**
+     * Deletes the container or key being unpacked if an exception
+     * is thrown before it is handed over. Objects in an Arena and
+     * interned keys are left alone.
+     */
+    struct ObjectScope
+    {
+      ObjectScope(Object* obj, Arena* arena) : obj_(arena == 0 ? obj : 0) {}
+
+      ~ObjectScope()
+      {
+        if(obj_ != 0 && !(obj_->getType() == RAW && ((Raw*) obj_)->isShared()))
+          delete obj_;
+      }
+
+      void release()
+      {
+        obj_ = 0;
+      }
+
+      Object* obj_;
+    };
+
+    //! Marks the elements of an STL container being populated
+    struct ElementScope
+    {
+      explicit ElementScope(Unpacker& unpacker) : unpacker_(unpacker)
+      {
+        unpacker_.elements_++;
+      }
+
+      ~ElementScope()
+      {
+        unpacker_.elements_--;
+      }
+
+      Unpacker& unpacker_;
+    };
+
+#ifdef MSGPACK_STATS
+    //! State of the message being recorded
+    struct StatsState
+    {
+      StatsState() : recorder(0), depth(0), start(0), objects(0) {}
+
+      bool recording() const
+      {
+        return recorder != 0 && depth > 0;
+      }
+
+      StatsRecorder* recorder;  //!< Where the Stats are recorded
+      std::size_t depth;        //!< Nesting of the public calls
+      const char* start;        //!< Start of the message in the memory region
+      uint64_t objects;         //!< Objects allocated by the message
+      std::string stream;       //!< Bytes of the message read from the stream
+    };
+
+    //! Records the message unpacked by the outermost public call
+    struct StatsScope
+    {
+      explicit StatsScope(Unpacker& unpacker) : unpacker_(unpacker)
+      {
+        StatsState& stats = unpacker_.stats_;
+        if(stats.recorder != 0 && stats.depth++ == 0)
+        {
+          stats.start = unpacker_.cur_;
+          stats.objects = 0;
+          stats.stream.clear();
+          stats.recorder->onBegin();
+        }
+      }
+
+      ~StatsScope()
+      {
+        StatsState& stats = unpacker_.stats_;
+        if(stats.depth > 0)
+          stats.depth--;
+      }
+
+      //! Called once the message has been unpacked successfully
+      void end()
+      {
+        StatsState& stats = unpacker_.stats_;
+        if(stats.recorder == 0 || stats.depth != 1)
+          return;
+
+        Stats message;
+        if(unpacker_.in_ == 0)
+          message.scan(stats.start, unpacker_.cur_ - stats.start);
+        else
+          message.scan(stats.stream.data(), stats.stream.size());
+        message.objects = stats.objects;
+        stats.recorder->record(message);
+      }
+
+      Unpacker& unpacker_;
+    };
+#endif
+
+    std::istream* in_;     //!< The stream we are unpacking the data from
+    const char* cur_;      //!< Next read position in the memory region
+    const char* end_;      //!< End of the memory region
+    bool zeroCopy_;        //!< Reference Raw data in the memory region
+    Arena* arena_;         //!< Arena the Objects are allocated in, if any
+    KeyCache* keys_;       //!< Cache where map keys are interned, if any
+    std::size_t elements_; //!< Nesting of the STL containers being populated
+#ifdef MSGPACK_STATS
+    StatsState stats_;     //!< State of the Stats being recorded
+#endif
+
+    friend class LazyDocument;
+    friend class MappedReader;
+
+}; // Unpacker
+
+#undef MSGPACK_STATS_SCOPE__
+#undef MSGPACK_STATS_END__
+
+inline std::size_t detail::count_elements(const char* data, std::size_t length)
+{
+  Unpacker unpacker(data, length);
+  std::size_t count = 0;
+  while (unpacker.remaining() > 0)
+  {
+    unpacker.skip();
+    count++;
+  }
+  return count;
+}
+
+namespace detail
+{
+
+/**
+ * Length of the run of positive and negative fixnums at the given
+ * position, up to max bytes. Blocks of 16 bytes are checked at once
+ * where SSE2 is available.
+ */
+inline std::size_t fixnum_run(const char* data, std::size_t max)
+{
+  std::size_t run = 0;
+#ifdef MSGPACK_SSE2__
+  const __m128i high = _mm_set1_epi8((char) 0xe0);
+  while (max - run >= 16)
+  {
+    __m128i bytes = _mm_loadu_si128((const __m128i*) (data + run));
+
+    // Positive fixnums have the high bit clear, negative ones the three high bits set
+    int positive = ~_mm_movemask_epi8(bytes) & 0xffff;
+    int negative = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bytes, high), high));
+    if ((positive | negative) != 0xffff)
+      break;
+    run += 16;
+  }
+#endif
+  while (run < max && ((uint8_t) data[run] < 0x80 || (uint8_t) data[run] >= 0xe0))
+    run++;
+  return run;
+}
+
+} // namespace detail
+
+/**
+ * Validator class. Checks that untrusted data holds a well formed
+ * message before it is handed to an Unpacker, without allocating
+ * anything but the stack of the open containers. Every length is
+ * checked against the bytes available, and messages nesting their
+ * containers too deep or taking too many bytes are rejected.
+ */
+class Validator
+{
+  private:
+
+    enum { STACK_SIZE = 32 };
+
+  public:
+
+    /**
+     * Progress of the validation of a message arriving in pieces. It
+     * keeps the open containers and the bytes checked so far, so that
+     * validating more data resumes where the previous call stopped.
+     */
+    class State
+    {
+      public:
+
+        State() : checked_(0), depth_(1)
+        {
+          local_[0] = 1;
+        }
+
+        //! Start over with a new message
+        void reset()
+        {
+          checked_ = 0;
+          depth_ = 1;
+          local_[0] = 1;
+          heap_.clear();
+        }
+
+        //! Bytes of the message checked so far, up to the last whole element
+        std::size_t checked() const
+        {
+          return checked_;
+        }
+
+      private:
+
+        friend class Validator;
+
+        //! Elements left in each of the open containers, the message itself first
+        uint64_t* open()
+        {
+          return heap_.empty() ? local_ : &heap_[0];
+        }
+
+        //! Make room for one more open container
+        uint64_t* push()
+        {
+          if (depth_ % STACK_SIZE == 0)
+          {
+            if (heap_.empty())
+              heap_.assign(local_, local_ + STACK_SIZE);
+            heap_.resize(depth_ + STACK_SIZE);
+          }
+          return open();
+        }
+
+        std::size_t checked_;          //!< Bytes checked up to the last whole element
+        std::size_t depth_;            //!< Number of open containers
+        uint64_t local_[STACK_SIZE];   //!< Stack of shallow messages, not allocated
+        std::vector<uint64_t> heap_;   //!< Stack of deeper messages
+
+    }; // State
+
+    /**
+     * Constructor
+     * @param maxDepth Deepest nesting of containers accepted
+     * @param maxLength Largest message accepted, in bytes
+     */
+    explicit Validator(std::size_t maxDepth = 64, std::size_t maxLength = std::size_t(-1)) :
+      maxDepth_(maxDepth), maxLength_(maxLength) {}
+
+    /**
+     * Validate the first message of the given data. An unpack_exception
+     * is thrown if it is malformed or goes over the limits.
+     * @param data Pointer to the data
+     * @param length Length of the data in bytes
+     * @return The exact length of the message in bytes, or 0 if the
+     * data ends before it is complete.
+     */
+    std::size_t validate(const char* data, std::size_t length) const MSGPACK_THROW__(unpack_exception)
+    {
+      State state;
+      return validate(data, length, state);
+    }
+
+    /**
+     * Validate the first message of the given data, resuming from the
+     * given state of a previous call over a prefix of the same message.
+     * The data may have moved in between, e.g. into a larger buffer.
+     * Once the message is complete the state must be reset before
+     * validating the next one.
+     * @param data Pointer to the data
+     * @param length Length of the data in bytes
+     * @param state Progress of the validation, updated by the call
+     * @return The exact length of the message in bytes, or 0 if the
+     * data ends before it is complete.
+     */
+    std::size_t validate(const char* data, std::size_t length, State& state) const
+      MSGPACK_THROW__(unpack_exception)
+    {
+      using namespace detail;
+
+      const char* cur = data + state.checked_;
+      const char* end = data + std::min(length, maxLength_);
+      uint64_t* open = state.open();
+      std::size_t& depth = state.depth_;
+      while (depth > 0)
+      {
+        if (open[depth - 1] == 0)
+        {
+          depth--;
+          continue;
+        }
+        if (cur == end)
+          return incomplete(state, cur - data, end - data);
+
+        std::size_t run = fixnum_run(cur, std::min<uint64_t>(open[depth - 1], end - cur));
+        if (run > 0)
+        {
+          cur += run;
+          open[depth - 1] -= run;
+          continue;
+        }
+
+        // Elements are only consumed once whole, so that a call
+        // stopping in the middle of one resumes from its header
+        element_layout layout((uint8_t) *cur);
+        std::size_t available = end - cur - 1;
+        if (layout.type != RAW && layout.type != ARRAY && layout.type != MAP)
+        {
+          if (available < layout.size - 1)
+            return incomplete(state, cur - data, end - data);
+          cur += layout.size;
+          open[depth - 1]--;
+          continue;
+        }
+
+        if (available < layout.lengthBytes)
+          return incomplete(state, cur - data, end - data);
+
+        uint64_t size = layout.length;
+        if (layout.lengthBytes == 2)
+          size = load_network<uint16_t>(cur + 1);
+        else if (layout.lengthBytes == 4)
+          size = load_network<uint32_t>(cur + 1);
+        std::size_t header = 1 + layout.lengthBytes;
+        available -= layout.lengthBytes;
+
+        // Every element takes at least one byte, just like raw data
+        if (layout.type == MAP)
+          size *= 2;
+        if (size > maxLength_ - std::size_t(cur + header - data))
+          throw unpack_exception("Message longer than the limit");
+
+        if (layout.type == RAW)
+        {
+          if (available < size)
+            return incomplete(state, cur - data, end - data);
+          cur += header + size;
+          open[depth - 1]--;
+          continue;
+        }
+
+        if (depth > maxDepth_)
+          throw unpack_exception("Containers nested deeper than the limit");
+
+        cur += header;
+        open[depth - 1]--;
+        open = state.push();
+        open[depth++] = size;
+      }
+      state.checked_ = cur - data;
+      return cur - data;
+    }
+
+  private:
+
+    //! Result when the data ends before the message does
+    std::size_t incomplete(State& state, std::size_t checked, std::size_t available) const
+      MSGPACK_THROW__(unpack_exception)
+    {
+      state.checked_ = checked;
+      if (available == maxLength_)
+        throw unpack_exception("Message longer than the limit");
+      return 0;
+    }
+
+    std::size_t maxDepth_;   //!< Deepest nesting of containers
+    std::size_t maxLength_;  //!< Largest message in bytes
+
+}; // Validator
+
+/**
+ * IncrementalUnpacker class. Allows to deserialize MessagePack
+ * binary data as it arrives, e.g. from non-blocking sockets. Data
+ * is fed as it is received, and top level Objects are handed out
+ * once complete. Partially decoded containers are kept in an
+ * explicit stack, so no thread is ever blocked waiting for data.
+ */
+class IncrementalUnpacker
+{
+  public:
+
+    /**
+     * Constructor
+     */
+    IncrementalUnpacker() : pos_(0) {}
+
+    /**
+     * Destructor. Deletes any partially decoded Object.
+     */
+    ~IncrementalUnpacker()
+    {
+      reset();
+    }
+
+    /**
+     * Append new data to the one pending to be unpacked
+     * @param data Pointer to the data
+     * @param length Length of the data in bytes
+     */
+    void feed(const char* data, std::size_t length)
+    {
+      // Drop the consumed data before growing the buffer
+      if (pos_ > 0 && buffer_.size() + length > buffer_.capacity())
+      {
+        buffer_.erase(buffer_.begin(), buffer_.begin() + pos_);
+        pos_ = 0;
+      }
+      buffer_.insert(buffer_.end(), data, data + length);
+    }
+
+    /**
+     * Decode as much of the data fed so far as possible, until the
+     * next top level Object is complete.
+     * This method throws an {@see unpack_exception} on invalid data,
+     * after which reset() must be called before feeding more data.
+     * @param obj Set to the next complete Object. The caller is
+     * responsible for deleting it.
+     * @return true if an Object was completed, false if more
+     * data is needed.
+     */
+    bool next(Object*& obj) MSGPACK_THROW__(unpack_exception)
+    {
+      Object* item = 0;
+      while (parseItem(item))
+      {
+        // Attach the complete item to the enclosing containers
+        while (item != 0 && !stack_.empty())
+        {
+          Frame& frame = stack_.back();
+          if (frame.container->getType() == ARRAY)
+          {
+            ((Array*) frame.container)->add(item);
+            frame.remaining--;
+          }
+          else if (frame.key == 0)
+          {
+            frame.key = item;
+            item = 0;
+            break;
+          }
+          else
+          {
+            ((Map*) frame.container)->insert(frame.key, item);
+            frame.key = 0;
+            frame.remaining--;
+          }
+
+          item = 0;
+          if (frame.remaining == 0)
+          {
+            item = frame.container;
+            stack_.pop_back();
+          }
+        }
+
+        if (item != 0)
+        {
+          obj = item;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * Number of bytes fed not decoded yet
+     */
+    std::size_t buffered() const
+    {
+      return buffer_.size() - pos_;
+    }
+
+    /**
+     * Number of containers partially decoded
+     */
+    std::size_t depth() const
+    {
+      return stack_.size();
+    }
+
+    /**
+     * Drop all the pending data and partially decoded Objects
+     */
+    void reset()
+    {
+      for (std::size_t i = 0; i < stack_.size(); i++)
+      {
+        delete stack_[i].container;
+        delete stack_[i].key;
+      }
+      stack_.clear();
+      buffer_.clear();
+      pos_ = 0;
+    }
+
+  private:
+
+    //! A container being decoded
+    struct Frame
+    {
+      Object* container;     //!< The Array or Map
+      Object* key;           //!< Map key waiting for its value
+      std::size_t remaining; //!< Number of elements or entries left
+    };
+
+    IncrementalUnpacker(const IncrementalUnpacker&);
+    IncrementalUnpacker& operator=(const IncrementalUnpacker&);
+
+    /**
+     * Decode the next item. Scalars and raws are decoded whole, while
+     * for containers just the header is, pushing them onto the stack.
+     * @param item Set to the complete item, or null if a container
+     * with pending elements was pushed.
+     * @return false if more data is needed.
+     */
+    bool parseItem(Object*& item) MSGPACK_THROW__(unpack_exception)
+    {
+      if (pos_ == buffer_.size())
+      {
+        buffer_.clear();
+        pos_ = 0;
+        return false;
+      }
+
+      const char* p = &buffer_[pos_];
+      std::size_t avail = buffer_.size() - pos_;
+      uint8_t header = *p;
+
+      detail::element_layout layout(header);
+      std::size_t size = layout.size;
+      std::size_t lengthBytes = layout.lengthBytes;
+      uint32_t length = layout.length;
+      object_type type = layout.type;
+
+      if (lengthBytes > 0)
+      {
+        if (avail < 1 + lengthBytes)
+          return false;
+
+        if (lengthBytes == 2)
+          length = detail::load_network<uint16_t>(p + 1);
+        else
+          length = detail::load_network<uint32_t>(p + 1);
+        size += lengthBytes;
+      }
+
+      if (type == ARRAY || type == MAP)
+      {
+        pos_ += size;
+
+        std::size_t hint = buffered() < length ? buffered() : length;
+        if (type == ARRAY)
+        {
+          Array* array = new Array();
+          array->reserve(hint);
+          item = array;
+        }
+        else
+        {
+          Map* map = new Map();
+          map->reserve(hint);
+          item = map;
+        }
+
+        if (length > 0)
+        {
+          Frame frame = { item, 0, length };
+          stack_.push_back(frame);
+          item = 0;
+        }
+        return true;
+      }
+
+      if (type == RAW)
+        size += length;
+
+      if (avail < size)
+        return false;
+
+      Unpacker unpacker(p, size);
+      item = unpacker.unpack();
+      pos_ += size;
+      return true;
+    }
+
+    std::vector<char> buffer_;  //!< Data fed not decoded yet
+    std::size_t pos_;           //!< Position of the next byte to decode
+    std::vector<Frame> stack_;  //!< Containers being decoded
+
+}; // IncrementalUnpacker
+
+class LazyDocument;
 
 /**
- * Unpacker class. Allows to deserialize MessagePack binary data
- * from a stream
+ * LazyValue class. A handle to an element of a {@see LazyDocument},
+ * which is only decoded when its value is retrieved. The elements of
+ * arrays and maps are located on first access, the positions found
+ * being kept by the document for later accesses.
+ * Handles are cheap to copy, and remain valid as long as the
+ * document they belong to.
  */
-class Unpacker
+class LazyValue
 {
   public:
 
     /**
-     * Constructor
-     * @param in Unpacker input stream from where the binary data is taken
+     * Constructor. Builds an invalid handle, as returned by find()
+     * when the key is not in the map.
      */
-    Unpacker(std::istream& in) : in_(in) {}
+    LazyValue() : doc_(0), data_(0), type_(NIL), size_(0) {}
 
     /**
-     * This method allows to unpack an object of any type
-     * which implements the Parcelable interface.
-     * @param p Reference to an object to be unpacked
+     * Returns false for handles not referencing any element
      */
-    Unpacker& unpack(Parcelable& p)
+    bool isValid() const
     {
-      p.unpack(*this);
-      return *this;
+      return data_ != 0;
     }
 
     /**
-     * This method allows to unpack an object of the given data
-     * type T. Should the data of the next element of the stream
-     * be from a different type or the stream be empty, and
-     * unpack_exception will be thrown.
-     * @param v Reference to the object to be populated with the
-     * unpacked data.
+     * Retrieve the object type of the element
      */
-    template<typename T>
-    Unpacker& unpack(T& v) throw(unpack_exception)
+    object_type getType() const
     {
-      using namespace detail;
-
-      Object* obj = 0;
-      if((obj = this->unpack())!=0)
-      {
-        if(obj->isNil())
-        {
-          delete obj;
-          throw unpack_exception("Null retrieved from the input stream");
-        }
+      return type_;
+    }
 
-        switch(obj->getType())
-        {
-          case BOOL:
-            v = (T) obj->getImpl<BOOL>().getValue();
-            break;
-          case INT8:
-            v = (T) obj->getImpl<INT8>().getValue();
-            break;
-          case INT16:
-            v = (T) obj->getImpl<INT16>().getValue();
-            break;
-          case INT32:
-            v = (T) obj->getImpl<INT32>().getValue();
-            break;
-          case INT64:
-            v = (T) obj->getImpl<INT64>().getValue();
-            break;
-          case UINT8:
-            v = (T) obj->getImpl<UINT8>().getValue();
-            break;
-          case UINT16:
-            v = (T) obj->getImpl<UINT16>().getValue();
-            break;
-          case UINT32:
-            v = (T) obj->getImpl<UINT32>().getValue();
-            break;
-          case UINT64:
-            v = (T) obj->getImpl<UINT64>().getValue();
-            break;
-          case FLOAT:
-            v = (T) obj->getImpl<FLOAT>().getValue();
-            break;
-          case DOUBLE:
-            v = (T) obj->getImpl<DOUBLE>().getValue();
-            break;
-          default:
-            break;
-        }
-        delete obj;
-      }
-      else
-      {
-        throw unpack_exception("Unable to get next object from stream");
-      }
+    /**
+     * Returns true if the element is nil
+     */
+    bool isNil() const
+    {
+      return type_ == NIL;
+    }
 
-      return *this;
+    /**
+     * Number of bytes of a RAW element, elements of an
+     * ARRAY or entries of a MAP. Zero otherwise.
+     */
+    std::size_t size() const
+    {
+      return size_;
     }
 
     /**
-     * This method allows unpacking a generic C++ string.
-     * Should the next element of the stream not be a string of the provided
-     * type or a different object, or the stream be null, an unpack_exception
-     * will be thrown.
-     * @param v Reference to the string to be populated.
+     * Retrieve a scalar element converted into the type T, the same
+     * way {@see Unpacker::unpack(T&)} does. Throws std::bad_cast
+     * for nil, RAW, ARRAY and MAP elements, and an unpack_exception
+     * if the element can not be converted into a T.
      */
-    template<typename char_t>
-    Unpacker& unpack(std::basic_string<char_t>& v) throw(unpack_exception)
+    template<typename T>
+    T as() const MSGPACK_THROW2__(std::bad_cast, unpack_exception)
     {
-      using namespace detail;
+      if (type_ == NIL || type_ == RAW || type_ == ARRAY || type_ == MAP)
+        throw std::bad_cast();
 
-      Object* obj = 0;
-      if((obj = this->unpack())!=0)
-      {
-        if(obj->isNil())
-        {
-          delete obj;
-          throw unpack_exception("Null retrieved from the input stream");
-        }
+      T v = T();
+      unpack(v);
+      return v;
+    }
 
-        if(obj->getType()!=RAW)
-        {
-          delete obj;
-          throw unpack_exception("Unable to get next object from stream");
-        }
+    /**
+     * Retrieve the data of a RAW element, pointing to the document
+     * buffer. Throws std::bad_cast for any other type.
+     */
+    RawRef getRaw() const MSGPACK_THROW2__(std::bad_cast, unpack_exception);
 
-        Raw& raw = (Raw&) obj->getImpl<RAW>();
-        v = (std::basic_string<char_t>) raw;
+    /**
+     * Retrieve the element at the given position of an ARRAY.
+     * Throws std::bad_cast for any other type, and std::out_of_range
+     * for positions past its end.
+     */
+    LazyValue operator[](std::size_t i) const;
 
-        delete obj;
-      }
-      else
-      {
-        throw unpack_exception("Unable to get next object from stream");
-      }
+    /**
+     * Retrieve the key of the entry at the given position of a MAP.
+     * Throws as {@see operator[]} does.
+     */
+    LazyValue key(std::size_t i) const;
 
-      return *this;
-    }
+    /**
+     * Retrieve the value of the entry at the given position of a MAP.
+     * Throws as {@see operator[]} does.
+     */
+    LazyValue value(std::size_t i) const;
 
     /**
-     * Equivalent to unpack(T&)
+     * Look for the value of a MAP entry whose key is a RAW holding
+     * the given data. Returns an invalid handle if there's none.
+     * @param key Pointer to the key data
+     * @param length Length of the key in bytes
      */
-    template<typename T>
-    Unpacker& operator>>(T& v) throw(unpack_exception)
-    {
-      return unpack(v);
-    }
+    LazyValue find(const char* key, std::size_t length) const;
 
     /**
-     * Equivalent to unpack(std::basic_string<char_t>&)
+     * Look for the value of a MAP entry with the given string key
      */
     template<typename char_t>
-    Unpacker& operator>>(std::basic_string<char_t>& v) throw(unpack_exception)
+    LazyValue find(const std::basic_string<char_t>& key) const
     {
-      return unpack(v);
+      return find((const char*) key.data(), key.size() * sizeof(char_t));
     }
 
     /**
-     * Equivalent to unpack(Parcelable&)
+     * Look for the value of a MAP entry with the given null terminated key
      */
-    Unpacker& operator>>(Parcelable& v) throw (unpack_exception)
+    LazyValue find(const char* key) const
     {
-      return unpack(v);
+      return find(key, strlen(key));
     }
 
     /**
-     * Builds an Object from the available data in the input
-     * stream. The caller is responsible for deleting the returned
-     * instance.
-     * This method may throw an {@see unpack_exception} in case the
-     * buffer runs out of data while trying to deserialize.
+     * Decode the whole element into v, as {@see Unpacker::unpack(T&)} does
      */
-    Object* unpack() throw(unpack_exception)
-    {
-      using namespace detail;
+    template<typename T>
+    void unpack(T& v) const MSGPACK_THROW__(unpack_exception);
 
-      if(in_.eof())
-        throw unpack_exception("Reached end of stream");
+    /**
+     * Decode the whole element into a new Object, which
+     * should be deleted by the caller
+     */
+    Object* unpack() const MSGPACK_THROW__(unpack_exception);
 
-      uint8_t value;
-      read(value); // Read the header
+  private:
 
-      type_traits<FLOAT>::type  fVal;
-      type_traits<DOUBLE>::type dVal;
-      type_traits<INT8>::type   int8Val;
-      type_traits<INT16>::type  int16Val;
-      type_traits<INT32>::type int32Val;
-      type_traits<INT64>::type int64Val;
-      type_traits<UINT8>::type uint8Val;
-      type_traits<UINT16>::type uint16Val;
-      type_traits<UINT32>::type uint32Val;
-      type_traits<UINT64>::type uint64Val;
+    friend class LazyDocument;
 
-      switch (value)
-      {
-        case bm::MP_NULL:
-          return new Nil();
-        case bm::MP_FALSE:
-          return new Bool(false);
-        case bm::MP_TRUE:
-          return new Bool(true);
-        case bm::MP_FLOAT:
-          read(fVal);
-          return new Float(fVal);
-        case bm::MP_DOUBLE:
-          read(dVal);
-          return new Double(dVal);
-        case bm::MP_UINT8:
-          read(uint8Val);
-          return new UInt8(uint8Val);
-        case bm::MP_UINT16:
-          read(uint16Val);
-          return new UInt16(uint16Val);
-        case bm::MP_UINT32:
-          read(uint32Val);
-          return new UInt32(uint32Val);
-        case bm::MP_UINT64:
-          read(uint64Val);
-          return new UInt64(uint64Val);
-        case bm::MP_INT8:
-          read(int8Val);
-          return new Int8(int8Val);
-        case bm::MP_INT16:
-          read(int16Val);
-          return new Int16(int16Val);
-        case bm::MP_INT32:
-          read(int32Val);
-          return new Int32(int32Val);
-        case bm::MP_INT64:
-          read(int64Val);
-          return new Int64(int64Val);
-        case bm::MP_ARRAY16:
-          read(int16Val);
-          return unpackArray(int16Val);
-        case bm::MP_ARRAY32:
-          read(int32Val);
-          return unpackArray(int32Val);
-        case bm::MP_MAP16:
-          read(int16Val);
-          return unpackMap(int16Val);
-        case bm::MP_MAP32:
-          read(int16Val);
-          return unpackMap(int16Val);
-        case bm::MP_RAW16:
-          read(int16Val);
-          return unpackRaw(int16Val);
-        case bm::MP_RAW32:
-          read(int32Val);
-          return unpackRaw(int32Val);
-      }
+    //! Build a handle to the element starting at the given position
+    LazyValue(const LazyDocument* doc, const char* data) MSGPACK_THROW__(unpack_exception);
 
-      if (((uint8_t)(value & 0xE0)) == bm::MP_FIXRAW)
-      {
-        return unpackRaw(value - bm::MP_FIXRAW);
-      }
+    //! Handle to the element at the given position of the container index
+    LazyValue child(std::size_t i) const;
 
-      if (((uint8_t)(value & 0xE0)) == bm::MP_NEGATIVE_FIXNUM)
-      {
-        return new Int32((value & 0x1F) - 32);
-      }
+    const LazyDocument* doc_;  //!< The document the element belongs to
+    const char* data_;         //!< Position of the element header
+    object_type type_;         //!< Type of the element
+    std::size_t size_;         //!< Length of raws, arrays and maps
 
-      if (((uint8_t)(value & 0xF0)) == bm::MP_FIXARRAY)
-      {
-        return unpackArray(value - bm::MP_FIXARRAY);
-      }
+}; // LazyValue
 
-      if (((uint8_t)(value & 0xF0)) == bm::MP_FIXMAP)
-      {
-        return unpackMap(value - bm::MP_FIXMAP);
-      }
+/**
+ * LazyDocument class. Gives access to the MessagePack data in a memory
+ * region without decoding it upfront: only the elements reached
+ * through {@see LazyValue} handles are decoded. The data is not
+ * copied, so it must outlive the document.
+ * A document is not thread safe: the container indexes are built on
+ * first use even from const methods, so concurrent readers need a
+ * document each or external locking.
+ */
+class LazyDocument
+{
+  public:
 
-      if (value <= 127) //MP_FIXNUM
-      {
-        return new Int8(value);
-      }
-      else
-      {
-        return 0;
-      }
+    /**
+     * Constructor
+     * @param data Pointer to the beginning of the MessagePack data
+     * @param length Length of the data in bytes
+     */
+    LazyDocument(const char* data, std::size_t length) :
+      data_(data), end_(data + length) {}
+
+    /**
+     * Retrieve a handle to the first element of the document
+     */
+    LazyValue root() const MSGPACK_THROW__(unpack_exception)
+    {
+      return LazyValue(this, data_);
     }
 
   private:
 
-    //! Unpack an array
-    Array* unpackArray(int size)
-    {
-      if (size < 0)
-        return 0;
+    friend class LazyValue;
 
-      Array* ret = new Array();
-      for (int i = 0; i < size; ++i)
-      {
-        ret->add(unpack());
-      }
-      return ret;
-    }
+    typedef std::vector<const char*> index_type;
 
-    //! Unpack a map
-    Map* unpackMap(int size)
+    LazyDocument(const LazyDocument&);
+    LazyDocument& operator=(const LazyDocument&);
+
+    /**
+     * Positions of the elements of the ARRAY, or of the keys and
+     * values of the MAP, at the given position, found on first use
+     */
+    const index_type& index(const char* container, object_type type) const
+      MSGPACK_THROW__(unpack_exception)
     {
-      if (size < 0)
-        return 0;
+      std::map<const char*, index_type>::iterator it = indexes_.find(container);
+      if (it != indexes_.end())
+        return it->second;
 
-      Map* ret = new Map();
+      index_type index;
+      Unpacker unpacker(container, end_ - container);
+      std::size_t count = (type == ARRAY) ?
+        unpacker.unpackArrayHeader() : unpacker.unpackMapHeader() * 2;
 
-      for (int i = 0; i < size; ++i)
+      index.reserve(unpacker.reserveHint(count));
+      for (std::size_t i = 0; i < count; i++)
       {
-        Object* key = unpack();
-        Object* val = unpack();
-        ret->insert(key, val);
+        index.push_back(unpacker.cur_);
+        unpacker.skip();
       }
-      return ret;
+      return indexes_.insert(std::make_pair(container, index)).first->second;
     }
 
+    const char* data_;  //!< Beginning of the data
+    const char* end_;   //!< End of the data
+    mutable std::map<const char*, index_type> indexes_;  //!< Container indexes
 
-    //! Unpack raw data
-    Raw* unpackRaw(int size)
-    {
-      if (size < 0)
-        return 0;
+}; // LazyDocument
 
-      detail::type_traits<RAW>::type data =
-        new detail::remove_pointer<detail::type_traits<RAW>::type>::type[size];
+inline LazyValue::LazyValue(const LazyDocument* doc, const char* data)
+  MSGPACK_THROW__(unpack_exception) :
+  doc_(doc), data_(data), type_(NIL), size_(0)
+{
+  std::size_t avail = doc->end_ - data;
+  if (avail == 0)
+    throw unpack_exception("Reached end of buffer while reading");
+
+  detail::element_layout layout(*data);
+  if (avail < layout.size + layout.lengthBytes)
+    throw unpack_exception("Reached end of buffer while reading");
+
+  type_ = layout.type;
+  size_ = layout.length;
+  if (layout.lengthBytes == 2)
+    size_ = detail::load_network<uint16_t>(data + 1);
+  else if (layout.lengthBytes == 4)
+    size_ = detail::load_network<uint32_t>(data + 1);
+
+  // Raws are referenced by getRaw(), so their data must be there
+  if (type_ == RAW && avail - layout.size - layout.lengthBytes < size_)
+    throw unpack_exception("Reached end of buffer while reading");
+}
+
+inline RawRef LazyValue::getRaw() const MSGPACK_THROW2__(std::bad_cast, unpack_exception)
+{
+  if (type_ != RAW)
+    throw std::bad_cast();
 
-      for(int i = 0;i<size;i++)
-        read(data[i]);
+  RawRef v;
+  unpack(v);
+  return v;
+}
 
-      return new Raw(data, size);
-    }
+inline LazyValue LazyValue::child(std::size_t i) const
+{
+  return LazyValue(doc_, doc_->index(data_, type_).at(i));
+}
 
-    //! Read an object of the given type from the underlying stream
-    template<typename T>
-    Unpacker& read(T& ret) throw(unpack_exception)
-    {
-      if(in_.eof())
-        throw unpack_exception("Reached end of stream while reading");
+inline LazyValue LazyValue::operator[](std::size_t i) const
+{
+  if (type_ != ARRAY)
+    throw std::bad_cast();
 
-      in_.read((char*) &ret, sizeof(T));
+  return child(i);
+}
 
-      return *this;
+inline LazyValue LazyValue::key(std::size_t i) const
+{
+  if (type_ != MAP)
+    throw std::bad_cast();
+
+  return child(i * 2);
+}
+
+inline LazyValue LazyValue::value(std::size_t i) const
+{
+  if (type_ != MAP)
+    throw std::bad_cast();
+
+  return child(i * 2 + 1);
+}
+
+inline LazyValue LazyValue::find(const char* key, std::size_t length) const
+{
+  for (std::size_t i = 0; i < size_ && type_ == MAP; i++)
+  {
+    LazyValue k = this->key(i);
+    if (k.type_ == RAW && k.size_ == length)
+    {
+      RawRef raw = k.getRaw();
+      if (std::memcmp(raw.data, key, length) == 0)
+        return value(i);
     }
+  }
+  return LazyValue();
+}
 
-    std::istream& in_; //!< The stream we are unpacking the data from
+template<typename T>
+inline void LazyValue::unpack(T& v) const MSGPACK_THROW__(unpack_exception)
+{
+  Unpacker unpacker(data_, doc_->end_ - data_, true);
+  unpacker.unpack(v);
+}
 
-}; // Unpacker
+inline Object* LazyValue::unpack() const MSGPACK_THROW__(unpack_exception)
+{
+  Unpacker unpacker(data_, doc_->end_ - data_);
+  return unpacker.unpack();
+}
 
 } // namespace MSGPACK_NAMESPACE__
 
+// Variadic macros were only standardized by C++11
+#if __cplusplus >= 201103L
+
+/**
+ * Declares the fields of a class or struct, which are then packed
+ * and unpacked in the given order as an array, with no Parcelable
+ * virtual dispatch involved. Up to 16 fields are supported. It must
+ * be placed in a public section of the type declaration. Requires
+ * C++11:
+ *
+ * struct Point
+ * {
+ *   int x, y;
+ *   MSGPACK_FIELDS(x, y)
+ * };
+ */
+#define MSGPACK_FIELDS(...) \
+    typedef void msgpack_fields_tag; \
+    enum { msgpack_fields_count = MSGPACK_NARGS__(__VA_ARGS__) }; \
+    void msgpack_pack(::MSGPACK_NAMESPACE__::Packer& packer__) const \
+    { \
+      packer__.packArrayHeader<msgpack_fields_count>(); \
+      MSGPACK_EACH__(MSGPACK_PACK_FIELD__, __VA_ARGS__) \
+    } \
+    void msgpack_unpack(::MSGPACK_NAMESPACE__::Unpacker& unpacker__) \
+    { \
+      if (unpacker__.unpackArrayHeader() != std::size_t(msgpack_fields_count)) \
+        throw ::MSGPACK_NAMESPACE__::unpack_exception("Unexpected number of fields"); \
+      MSGPACK_EACH__(MSGPACK_UNPACK_FIELD__, __VA_ARGS__) \
+    }
+
+#define MSGPACK_PACK_FIELD__(__FIELD__) packer__.pack(__FIELD__);
+#define MSGPACK_UNPACK_FIELD__(__FIELD__) unpacker__.unpack(__FIELD__);
+
+//! Helpers to apply a macro to each of the fields
+#define MSGPACK_NARGS__(...) MSGPACK_NARGS_N__(__VA_ARGS__, 16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1)
+#define MSGPACK_NARGS_N__(_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,_11,_12,_13,_14,_15,_16, N, ...) N
+#define MSGPACK_CAT__(a, b) MSGPACK_CAT_I__(a, b)
+#define MSGPACK_CAT_I__(a, b) a ## b
+#define MSGPACK_EACH__(__M__, ...) MSGPACK_CAT__(MSGPACK_EACH_, MSGPACK_CAT__(MSGPACK_NARGS__(__VA_ARGS__), __))(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_1__(__M__, _1) __M__(_1)
+#define MSGPACK_EACH_2__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_1__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_3__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_2__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_4__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_3__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_5__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_4__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_6__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_5__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_7__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_6__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_8__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_7__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_9__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_8__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_10__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_9__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_11__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_10__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_12__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_11__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_13__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_12__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_14__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_13__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_15__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_14__(__M__, __VA_ARGS__)
+#define MSGPACK_EACH_16__(__M__, _1, ...) __M__(_1) MSGPACK_EACH_15__(__M__, __VA_ARGS__)
+
+#endif // __cplusplus >= 201103L
+
 #endif // _MSGPACK_LITE_HPP_
@@ -33,15 +33,71 @@
  *
  */
 
+// The Stats of the Unpacker are tested along with the rest
+#define MSGPACK_STATS
+
 #include "msgpack/msgpack-lite.hpp"
+#include "msgpack/msgpack-lite-mmap.hpp"
+#include "msgpack/msgpack-lite-parallel.hpp"
+#include "msgpack/msgpack-lite-log.hpp"
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include "msgpack/msgpack-lite-coro.hpp"
+#endif
 
 #include <gtest/gtest.h>
 
 #include <sstream>
+#include <fstream>
 #include <limits>
+#include <cstdio>
+#include <cstdlib>
 
 using testing::Types;
 
+// Allocations alive, counted while liveAllocations.counting is set
+struct LiveAllocations {
+	bool counting;
+	long count;
+} liveAllocations = { false, 0 };
+
+void* operator new(std::size_t size) MSGPACK_THROW__(std::bad_alloc)
+{
+	void* p = std::malloc(size ? size : 1);
+	if (p == 0)
+		throw std::bad_alloc();
+	if (liveAllocations.counting)
+		liveAllocations.count++;
+	return p;
+}
+
+void* operator new[](std::size_t size) MSGPACK_THROW__(std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+	if (p != 0 && liveAllocations.counting)
+		liveAllocations.count--;
+	std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	operator delete(p);
+}
+
+// Also replaced before C++14, as the libraries may call them
+void operator delete(void* p, std::size_t) throw()
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) throw()
+{
+	operator delete(p);
+}
+
 /*
  --------------------------------------------------------------------
  UNIT TESTS
@@ -264,6 +320,1805 @@ TYPED_TEST(TestStrings, pack_unpack)
 
 // TODO: test pointers, parcelable, array and maps
 
+//////////////////////////////////////////////////////////////////////
+
+TEST(TypedUnpack, nil_throws)
+{
+	std::stringstream ss;
+	Packer packer(ss);
+	Unpacker unpacker(ss);
+
+	const int* nullPtr = 0;
+	packer.pack(nullPtr);
+
+	int value = 0;
+	EXPECT_THROW(unpacker.unpack(value), unpack_exception);
+}
+
+TEST(TypedUnpack, non_scalar_is_consumed)
+{
+	std::stringstream ss;
+	Packer packer(ss);
+	Unpacker unpacker(ss);
+
+	std::string str("not a number");
+	std::vector<int> vec(20, 7);
+	packer.pack(str).pack(vec).pack(-5);
+
+	int value = 42;
+	unpacker >> value;
+	EXPECT_EQ(42, value);
+	unpacker >> value;
+	EXPECT_EQ(42, value);
+	unpacker >> value;
+	EXPECT_EQ(-5, value);
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+TEST(BufferPacker, same_output_as_stream)
+{
+	std::stringstream ss;
+	Packer packer(ss);
+	BufferPacker<> bufPacker;
+
+	std::map<std::string, std::vector<int> > value;
+	value["small"] = std::vector<int>(3, 1);
+	value["large"] = std::vector<int>(1000, -100000);
+	std::string blob(70000, 'x');
+
+	packer.pack(value).pack(blob).pack(3.5).pack(-((int64_t) 1 << 40));
+	bufPacker.pack(value).pack(blob).pack(3.5).pack(-((int64_t) 1 << 40));
+
+	ASSERT_EQ(ss.str().size(), bufPacker.size());
+	EXPECT_EQ(ss.str(), std::string(bufPacker.data(), bufPacker.size()));
+
+	std::stringstream out;
+	bufPacker.flush(out);
+	EXPECT_EQ(ss.str(), out.str());
+	EXPECT_EQ(0u, bufPacker.size());
+
+	bufPacker.pack(blob);
+	std::string released;
+	BufferPacker<std::string> strPacker;
+	strPacker.pack(blob);
+	strPacker.release(released);
+	EXPECT_EQ(std::string(bufPacker.data(), bufPacker.size()), released);
+	EXPECT_EQ(0u, strPacker.size());
+}
+
+TEST(BufferPacker, fixed_region)
+{
+	char region[16];
+	BufferPacker<char*> packer(region, sizeof(region));
+
+	packer.pack(1).pack(2.0);
+	EXPECT_EQ(10u, packer.size());
+
+	std::stringstream ss(std::string(region, packer.size()));
+	Unpacker unpacker(ss);
+	int intVal = 0;
+	double doubleVal = 0;
+	unpacker >> intVal >> doubleVal;
+	EXPECT_EQ(1, intVal);
+	EXPECT_EQ(2.0, doubleVal);
+
+	EXPECT_THROW(packer.pack(3.0), pack_exception);
+}
+
+TEST(BufferPacker, unknown_length_containers)
+{
+	std::list<int> rows;
+	for (int i = 0; i < 300; i++)
+		rows.push_back(i * 1000);
+	std::map<std::string, int> entries;
+	entries["a"] = 1;
+	entries["b"] = 2;
+
+	for (int compact = 0; compact < 2; compact++) {
+		BufferPacker<> packer;
+		packer.beginArray();
+		for (std::list<int>::iterator it = rows.begin(); it != rows.end(); ++it)
+			packer.pack(*it);
+		packer.endArray(compact);
+		packer.beginMap();
+		packer.pack("a").pack(1).pack("b");
+		packer.beginArray().endArray(compact);
+		packer.endMap(compact);
+		packer.beginMap().pack("a").pack(1).pack("b").pack(2);
+		packer.endMap(compact);
+
+		Unpacker unpacker(packer.data(), packer.size());
+		std::list<int> rowsVal;
+		unpacker.unpack(rowsVal);
+		EXPECT_EQ(rows, rowsVal);
+		Object* obj = unpacker.unpack();
+		ASSERT_EQ(MAP, obj->getType());
+		EXPECT_EQ(2u, ((Map&) obj->getImpl<MAP>()).size());
+		delete obj;
+		std::map<std::string, int> entriesVal;
+		unpacker.unpack(entriesVal);
+		EXPECT_EQ(entries, entriesVal);
+		EXPECT_EQ(0u, unpacker.remaining());
+
+		// Compact headers take 3 bytes for the rows and 1 for the rest,
+		// instead of 5 bytes each
+		std::size_t rowsSize = Packer::packedSize(rows) - 3;
+		EXPECT_EQ(rowsSize + (compact ? 17 : 31), packer.size());
+	}
+
+	// Elements of known length containers and arrays packed in bulk
+	// count once, whatever their nesting
+	BufferPacker<> nested;
+	nested.beginArray();
+	nested.packArrayHeader(2).pack(1);
+	nested.beginMap().pack("k").pack(entries);
+	nested.endMap();
+	nested.pack(std::vector<int>(100, 7)).pack(rows);
+	nested.beginArray().beginArray().endArray().endArray();
+	nested.pack(Fragment(entries));
+	nested.endArray(true);
+	Unpacker nestedUnpacker(nested.data(), nested.size());
+	Object* obj = nestedUnpacker.unpack();
+	ASSERT_EQ(ARRAY, obj->getType());
+	EXPECT_EQ(5u, ((Array&) obj->getImpl<ARRAY>()).size());
+	delete obj;
+	EXPECT_EQ(0u, nestedUnpacker.remaining());
+
+	BufferPacker<> packer;
+	EXPECT_THROW(packer.endArray(), pack_exception);
+	packer.beginMap().pack(1);
+	EXPECT_THROW(packer.endMap(), pack_exception);
+	packer.beginArray();
+	EXPECT_THROW(packer.endMap(), pack_exception);
+	packer.packArrayHeader(2).pack(1);
+	EXPECT_THROW(packer.endArray(), pack_exception);
+}
+
+TEST(BufferPacker, network_byte_order)
+{
+	const unsigned char expected[] = {
+		0xcd, 0x12, 0x34,
+		0xce, 0x12, 0x34, 0x56, 0x78,
+		0xd1, 0xfe, 0xdc,
+		0xcb, 0x3f, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0xca, 0xc0, 0x20, 0x00, 0x00,
+		0xdc, 0x00, 0x10,
+		0xda, 0x01, 0x00
+	};
+
+	BufferPacker<> packer;
+	packer.pack(0x1234).pack(0x12345678).pack(-0x124).pack(1.0).pack(-2.5f);
+	packer.packArrayHeader(16);
+	std::string raw(256, 'r');
+	packer.pack(raw.data(), raw.size());
+	ASSERT_EQ(sizeof(expected) + raw.size(), packer.size());
+	EXPECT_EQ(0, std::memcmp(expected, packer.data(), sizeof(expected)));
+
+	Unpacker unpacker((const char*) expected, sizeof(expected));
+	int intVal = 0;
+	unpacker >> intVal;
+	EXPECT_EQ(0x1234, intVal);
+	unpacker >> intVal;
+	EXPECT_EQ(0x12345678, intVal);
+	unpacker >> intVal;
+	EXPECT_EQ(-0x124, intVal);
+	double doubleVal = 0;
+	unpacker >> doubleVal;
+	EXPECT_EQ(1.0, doubleVal);
+	float floatVal = 0;
+	unpacker >> floatVal;
+	EXPECT_EQ(-2.5f, floatVal);
+	EXPECT_EQ(16u, unpacker.unpackArrayHeader());
+
+	// The 256 bytes the raw header announces are not there
+	EXPECT_THROW(unpacker.unpack(), unpack_exception);
+}
+
+TEST(BufferPacker, string_lengths)
+{
+	std::string str("embedded\0null", 13);
+	std::wstring wstr(L"wide\0string", 11);
+	std::string longStr(3000, 'l');
+	const char data[] = "raw reference";
+	RawRef ref(data, 3);
+
+	BufferPacker<> packer;
+	packer.pack(str).pack(wstr).pack(longStr).pack(ref);
+
+	Unpacker unpacker(packer.data(), packer.size());
+	std::string strVal;
+	std::wstring wstrVal;
+	unpacker >> strVal;
+	EXPECT_EQ(str, strVal);
+	unpacker >> wstrVal;
+	EXPECT_EQ(wstr, wstrVal);
+	unpacker >> strVal;
+	EXPECT_EQ(longStr, strVal);
+	unpacker >> strVal;
+	EXPECT_EQ("raw", strVal);
+	EXPECT_EQ(0u, unpacker.remaining());
+
+#if __cplusplus >= 201703L
+	BufferPacker<> viewPacker;
+	viewPacker.pack(std::string_view(str)).pack(std::wstring_view(wstr));
+	Unpacker viewUnpacker(viewPacker.data(), viewPacker.size());
+	viewUnpacker >> strVal >> wstrVal;
+	EXPECT_EQ(str, strVal);
+	EXPECT_EQ(wstr, wstrVal);
+#endif
+}
+
+TEST(SegmentPacker, slices_match_buffer)
+{
+	std::string payload(5000, 'p');
+	std::vector<int> values(100, 70000);
+
+	SegmentPacker segments(64, 1024);
+	BufferPacker<> buffer;
+	for (int round = 0; round < 2; round++) {
+		segments.clear();
+		buffer.clear();
+		for (int i = 0; i < 10; i++) {
+			segments.pack(i).pack("message").pack(values);
+			segments.pack(payload.data(), payload.size());
+			buffer.pack(i).pack("message").pack(values);
+			buffer.pack(payload.data(), payload.size());
+		}
+
+		const std::vector<RawRef>& slices = segments.slices();
+		std::string joined;
+		std::size_t referenced = 0;
+		for (std::size_t i = 0; i < slices.size(); i++) {
+			EXPECT_TRUE(slices[i].size <= 64 || slices[i].data == payload.data());
+			referenced += slices[i].data == payload.data();
+			joined.append(slices[i].data, slices[i].size);
+		}
+		EXPECT_EQ(10u, referenced);
+		EXPECT_EQ(buffer.size(), segments.size());
+		EXPECT_EQ(std::string(buffer.data(), buffer.size()), joined);
+	}
+
+	std::stringstream ss;
+	segments.flush(ss);
+	EXPECT_EQ(0u, segments.size());
+	EXPECT_EQ(std::string(buffer.data(), buffer.size()), ss.str());
+}
+
+TEST(SegmentPacker, append_segments)
+{
+	std::string payload(5000, 'p');
+	std::string joined;
+	BufferPacker<> buffer;
+
+	SegmentPacker segments(64, 1024);
+	for (int round = 0; round < 2; round++) {
+		segments.clear();
+		buffer.clear();
+		segments.pack("head");
+		buffer.pack("head");
+		for (int i = 0; i < 3; i++) {
+			SegmentPacker other(i == 2 ? 128 : 64, 1024);
+			other.pack(std::vector<int>(50, i)).pack(payload.data(), payload.size());
+			buffer.pack(std::vector<int>(50, i)).pack(payload.data(), payload.size());
+			segments.append(other);
+			EXPECT_EQ(0u, other.size());
+			other.pack(i);
+		}
+		segments.pack("tail");
+		buffer.pack("tail");
+
+		const std::vector<RawRef>& slices = segments.slices();
+		joined.clear();
+		for (std::size_t i = 0; i < slices.size(); i++)
+			joined.append(slices[i].data, slices[i].size);
+		EXPECT_EQ(buffer.size(), segments.size());
+		EXPECT_EQ(std::string(buffer.data(), buffer.size()), joined);
+	}
+
+	segments.append(segments);
+	EXPECT_EQ(buffer.size(), segments.size());
+}
+
+//////////////////////////////////////////////////////////////////////
+
+TEST(MemoryUnpacker, unpack_from_region)
+{
+	BufferPacker<> packer;
+	std::string str("com.uoa.cs.test");
+	std::wstring wstr(L"wide string");
+	packer.pack(42).pack(str).pack(wstr).pack(-1.5f);
+
+	Unpacker unpacker(packer.data(), packer.size());
+	int intVal = 0;
+	std::string strVal;
+	std::wstring wstrVal;
+	float floatVal = 0;
+	unpacker >> intVal >> strVal >> wstrVal >> floatVal;
+	EXPECT_EQ(42, intVal);
+	EXPECT_EQ(str, strVal);
+	EXPECT_TRUE(wstr == wstrVal);
+	EXPECT_EQ(-1.5f, floatVal);
+
+	EXPECT_THROW(unpacker.unpack(), unpack_exception);
+}
+
+TEST(MemoryUnpacker, zero_copy_raw)
+{
+	BufferPacker<> packer;
+	std::string blob(1000, 'z');
+	packer.pack(blob).pack(blob);
+
+	Unpacker unpacker(packer.data(), packer.size(), true);
+	Object* obj = unpacker.unpack();
+	ASSERT_TRUE(obj != 0);
+	ASSERT_EQ(RAW, obj->getType());
+	Raw& raw = (Raw&) obj->getImpl<RAW>();
+	EXPECT_FALSE(raw.isOwner());
+	EXPECT_EQ(blob.size(), raw.size());
+	EXPECT_EQ(packer.data() + 3, (const char*) raw.getValue());
+	EXPECT_EQ(blob, (std::string) raw);
+	delete obj;
+
+	RawRef ref;
+	unpacker >> ref;
+	EXPECT_EQ(blob.size(), ref.size);
+	EXPECT_EQ(packer.data() + 6 + blob.size(), ref.data);
+}
+
+TEST(MemoryUnpacker, truncated_region)
+{
+	BufferPacker<> packer;
+	packer.pack(std::string(100, 'a'));
+
+	Unpacker unpacker(packer.data(), packer.size() - 1);
+	std::string str;
+	EXPECT_THROW(unpacker >> str, unpack_exception);
+
+	std::stringstream ss;
+	Unpacker streamUnpacker(ss);
+	RawRef ref;
+	EXPECT_THROW(streamUnpacker >> ref, unpack_exception);
+
+	std::stringstream truncated(std::string(packer.data(), packer.size() - 1));
+	Unpacker truncatedUnpacker(truncated);
+	EXPECT_THROW(truncatedUnpacker >> str, unpack_exception);
+}
+
+TEST(MemoryUnpacker, truncated_tree_is_released)
+{
+	std::map<std::string, std::vector<std::string> > value;
+	value["first"] = std::vector<std::string>(3, "element");
+	value["second"] = std::vector<std::string>(2, std::string(40, 's'));
+	BufferPacker<> packer;
+	packer.pack(value);
+
+	KeyCache keys;
+	keys.intern("first", 5);
+	keys.intern("second", 6);
+	std::string data(packer.data(), packer.size());
+	std::size_t failures = 0;
+	liveAllocations.count = 0;
+	liveAllocations.counting = true;
+	for (std::size_t length = 0; length < data.size(); length++)
+	{
+		Unpacker regionUnpacker(data.data(), length);
+		regionUnpacker.setKeyCache(length % 2 ? &keys : 0);
+		std::stringstream stream(data.substr(0, length));
+		Unpacker streamUnpacker(stream);
+		Unpacker* unpackers[] = { &regionUnpacker, &streamUnpacker };
+		for (int i = 0; i < 2; i++)
+		{
+			try
+			{
+				delete unpackers[i]->unpack();
+			}
+			catch (const unpack_exception&)
+			{
+				failures++;
+			}
+		}
+	}
+	liveAllocations.counting = false;
+	EXPECT_EQ(2 * data.size(), failures);
+	EXPECT_EQ(0, liveAllocations.count);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+TEST(ArenaUnpack, tree_in_arena)
+{
+	std::map<std::string, std::vector<int> > value;
+	value["first"] = std::vector<int>(10, 1);
+	value["second"] = std::vector<int>(1000, 70000);
+
+	BufferPacker<> packer;
+	packer.pack(value).pack(value);
+
+	Arena arena(256);
+	Unpacker unpacker(packer.data(), packer.size());
+	for (int msg = 0; msg < 2; msg++) {
+		Object* obj = unpacker.unpack(arena);
+		ASSERT_TRUE(obj != 0);
+		ASSERT_EQ(MAP, obj->getType());
+
+		const detail::map_type& map = obj->getImpl<MAP>().getValue();
+		ASSERT_EQ(2u, map.size());
+		for (detail::map_type::const_iterator it = map.begin(); it != map.end(); ++it) {
+			ASSERT_EQ(RAW, it->first->getType());
+			std::string key = (Raw&) it->first->getImpl<RAW>();
+			ASSERT_EQ(ARRAY, it->second->getType());
+			const detail::array_type& array = it->second->getImpl<ARRAY>().getValue();
+			EXPECT_EQ(value[key].size(), array.size());
+			EXPECT_EQ(key == "second" ? UINT32 : INT8, array.front()->getType());
+		}
+
+		// Objects are released all at once
+		arena.reset();
+	}
+}
+
+TEST(Containers, indexed_access_and_lookup)
+{
+	std::map<std::string, int> value;
+	for (int i = 0; i < 100; i++) {
+		std::stringstream key;
+		key << "key" << i;
+		value[key.str()] = i;
+	}
+	std::vector<double> vec;
+	vec.push_back(1.5);
+	vec.push_back(-2.5);
+
+	BufferPacker<> packer;
+	packer.pack(value).pack(vec);
+	Unpacker unpacker(packer.data(), packer.size());
+
+	Object* obj = unpacker.unpack();
+	ASSERT_EQ(MAP, obj->getType());
+	Map& map = (Map&) obj->getImpl<MAP>();
+	ASSERT_EQ(value.size(), map.size());
+
+	// Entries are kept in wire order
+	std::map<std::string, int>::const_iterator it = value.begin();
+	for (std::size_t i = 0; i < map.size(); i++, ++it)
+		EXPECT_EQ(it->first, (std::string) (Raw&) map[i].first->getImpl<RAW>());
+
+	Object* found = map.find("key42");
+	ASSERT_TRUE(found != 0);
+	EXPECT_EQ(42, found->getImpl<INT8>().getValue());
+	EXPECT_TRUE(map.find(std::string("key100")) == 0);
+	delete obj;
+
+	obj = unpacker.unpack();
+	ASSERT_EQ(ARRAY, obj->getType());
+	Array& array = (Array&) obj->getImpl<ARRAY>();
+	ASSERT_EQ(2u, array.size());
+	EXPECT_EQ(1.5, array[0]->getImpl<DOUBLE>().getValue());
+	EXPECT_EQ(-2.5, array[1]->getImpl<DOUBLE>().getValue());
+	delete obj;
+}
+
+TEST(Containers, release_children)
+{
+	std::string blob(1 << 20, 'b');
+	std::map<std::string, std::string> value;
+	value["blob"] = blob;
+	value["name"] = "x";
+	std::vector<std::string> list(3, blob);
+
+	BufferPacker<> packer;
+	packer.pack(value).pack(list);
+
+	for (int zeroCopy = 0; zeroCopy < 2; zeroCopy++) {
+		Unpacker unpacker(packer.data(), packer.size(), zeroCopy != 0);
+
+		Object* obj = unpacker.unpack();
+		Map& map = (Map&) obj->getImpl<MAP>();
+		Object* released = map.release("blob", 4);
+		ASSERT_TRUE(released != 0);
+		EXPECT_TRUE(map.find("blob") == 0);
+		EXPECT_TRUE(map.release(std::string("none")) == 0);
+		Object* name = map.release(1);
+		EXPECT_EQ("x", (std::string) (Raw&) name->getImpl<RAW>());
+		delete name;
+		delete obj;
+
+		Raw& raw = (Raw&) released->getImpl<RAW>();
+		const uint8_t* region = raw.getValue();
+		uint8_t* data = raw.release();
+		EXPECT_EQ(zeroCopy == 0, data == region);
+		EXPECT_EQ(blob, std::string((const char*) data, blob.size()));
+		EXPECT_EQ(zeroCopy == 0 ? 0u : blob.size(), raw.size());
+		delete[] data;
+		delete released;
+
+		obj = unpacker.unpack();
+		Array& array = (Array&) obj->getImpl<ARRAY>();
+		Object* first = array.release(0);
+		EXPECT_TRUE(array[0] == 0);
+		std::vector<Object*> rest;
+		array.release(rest);
+		ASSERT_EQ(3u, rest.size());
+		EXPECT_TRUE(rest[0] == 0);
+		EXPECT_EQ(0u, array.size());
+		delete obj;
+
+		std::string str(16, 's');
+		((Raw&) first->getImpl<RAW>()).assignTo(str);
+		EXPECT_EQ(blob, str);
+		delete first;
+		for (std::size_t i = 1; i < rest.size(); i++) {
+			EXPECT_EQ(blob, (std::string) (Raw&) rest[i]->getImpl<RAW>());
+			delete rest[i];
+		}
+	}
+}
+
+TEST(CompactValue, unpack_document)
+{
+	std::map<std::string, std::vector<int> > value;
+	value["ints"].push_back(-3);
+	value["ints"].push_back(300);
+	value["ints"].push_back(-100000);
+	value["empty"];
+
+	BufferPacker<> packer;
+	packer.pack(value).pack(2.25).pack(true);
+	std::string str("hello");
+	packer.pack(str);
+
+	EXPECT_EQ(16u, sizeof(Value));
+
+	Arena arena;
+	Unpacker unpacker(packer.data(), packer.size());
+	Value v;
+	unpacker.unpack(v, arena);
+	ASSERT_EQ(MAP, v.getType());
+	ASSERT_EQ(2u, v.size());
+	EXPECT_EQ("empty", std::string(v.key(0).getRaw().data, v.key(0).getRaw().size));
+	EXPECT_EQ(ARRAY, v.value(0).getType());
+	EXPECT_EQ(0u, v.value(0).size());
+
+	const Value* ints = v.find("ints");
+	ASSERT_TRUE(ints != 0);
+	ASSERT_EQ(3u, ints->size());
+	EXPECT_EQ(INT32, (*ints)[0].getType());
+	EXPECT_EQ(-3, (*ints)[0].as<int>());
+	EXPECT_EQ(UINT16, (*ints)[1].getType());
+	EXPECT_EQ(300, (*ints)[1].as<int>());
+	EXPECT_EQ(-100000, (*ints)[2].as<int>());
+	EXPECT_TRUE(v.find("missing") == 0);
+	EXPECT_THROW(v.as<int>(), std::bad_cast);
+
+	unpacker.unpack(v, arena);
+	EXPECT_EQ(2.25, v.as<double>());
+	unpacker.unpack(v, arena);
+	EXPECT_TRUE(v.as<bool>());
+	unpacker.unpack(v, arena);
+	EXPECT_EQ(str, std::string(v.getRaw().data, v.getRaw().size));
+	EXPECT_THROW(unpacker.unpack(v, arena), unpack_exception);
+	arena.reset();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class TestBulkPack: public testing::Test {
+};
+
+typedef Types<char, unsigned char, short, int, unsigned int, long,
+		unsigned long, float, double> BulkTypes;
+
+TYPED_TEST_CASE(TestBulkPack, BulkTypes);
+
+TYPED_TEST(TestBulkPack, same_output_as_element_wise)
+{
+	typedef std::numeric_limits<TypeParam> limits;
+
+	std::vector<TypeParam> values;
+	// A run of fixnums followed by values of every width
+	for (int i = 0; i < 300; i++)
+		values.push_back((TypeParam) (i % 100));
+	for (int i = 0; i < 1000; i++)
+		values.push_back((TypeParam) (limits::max() / (i + 1)));
+	for (int i = 0; i < 1000; i++)
+		values.push_back((TypeParam) (limits::min() / (i + 1)));
+	// Leaving a last block whose length is not a multiple of the SIMD width
+	values.push_back((TypeParam) 7);
+
+	std::stringstream ss;
+	Packer packer(ss);
+	packer.pack(values.begin(), values.end());
+
+	std::stringstream bulk;
+	Packer bulkPacker(bulk);
+	bulkPacker.pack(values);
+	EXPECT_EQ(ss.str(), bulk.str());
+
+	BufferPacker<> bufPacker;
+	bufPacker.packArray(&values[0], values.size());
+	EXPECT_EQ(ss.str(), std::string(bufPacker.data(), bufPacker.size()));
+
+	Unpacker unpacker(bufPacker.data(), bufPacker.size());
+	Object* obj = unpacker.unpack();
+	ASSERT_EQ(ARRAY, obj->getType());
+	EXPECT_EQ(values.size(), ((Array&) obj->getImpl<ARRAY>()).size());
+	delete obj;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class TestContainerUnpack: public testing::Test {
+};
+
+typedef Types<std::vector<float>, std::vector<double>, std::vector<int>,
+		std::vector<bool>, std::vector<std::string>, std::vector<std::vector<int> >,
+		std::list<short>, std::deque<uint64_t>, std::set<int>,
+		std::multiset<std::string> > ContainerTypes;
+
+TYPED_TEST_CASE(TestContainerUnpack, ContainerTypes);
+
+template<typename T>
+void fill(T& item, int i) {
+	item = (T) ((i % 3 == 0) ? i * 1000 : i - 20);
+}
+
+inline void fill(float& item, int i) {
+	item = (i % 100 == 99) ? 0 : i * 0.5f;
+}
+
+inline void fill(std::string& item, int i) {
+	item.assign(i % 50, 'a' + i % 26);
+}
+
+inline void fill(std::vector<int>& item, int i) {
+	item.assign(i % 5, i);
+}
+
+TYPED_TEST(TestContainerUnpack, round_trip)
+{
+	typedef typename TypeParam::value_type value_type;
+
+	TypeParam input;
+	for (int i = 0; i < 500; i++) {
+		value_type item;
+		fill(item, i);
+		input.insert(input.end(), item);
+	}
+
+	BufferPacker<> packer;
+	packer.pack(input);
+
+	// From a memory region, where the bulk path applies
+	TypeParam output;
+	Unpacker unpacker(packer.data(), packer.size());
+	unpacker >> output;
+	EXPECT_TRUE(input == output);
+
+	// And from a stream
+	std::stringstream ss(std::string(packer.data(), packer.size()));
+	Unpacker streamUnpacker(ss);
+	TypeParam streamOutput;
+	streamUnpacker >> streamOutput;
+	EXPECT_TRUE(input == streamOutput);
+}
+
+TEST(ContainerUnpack, broken_runs)
+{
+	// Runs of every length up to the vector width and beyond, split by integers
+	std::vector<double> doubles;
+	std::vector<float> floats;
+	BufferPacker<> packer;
+	packer.packArrayHeader(53);
+	for (int run = 1; run <= 9; run++) {
+		for (int i = 0; i < run; i++) {
+			doubles.push_back(run + i * 0.25);
+			packer.pack(doubles.back());
+		}
+		if (run < 9) {
+			doubles.push_back(run);
+			packer.pack(run);
+		}
+	}
+	packer.packArrayHeader(53);
+	for (int run = 1; run <= 9; run++) {
+		for (int i = 0; i < run; i++) {
+			floats.push_back(run + i * 0.5f);
+			packer.pack(floats.back());
+		}
+		if (run < 9) {
+			floats.push_back((float) -run);
+			packer.pack(-run);
+		}
+	}
+	ASSERT_EQ(53u, doubles.size());
+	ASSERT_EQ(53u, floats.size());
+
+	std::vector<double> unpackedDoubles;
+	std::vector<float> unpackedFloats;
+	Unpacker unpacker(packer.data(), packer.size());
+	unpacker >> unpackedDoubles >> unpackedFloats;
+	EXPECT_EQ(doubles, unpackedDoubles);
+	EXPECT_EQ(floats, unpackedFloats);
+}
+
+TEST(ContainerUnpack, mismatched_elements)
+{
+	BufferPacker<> packer;
+	packer.packArrayHeader(3).pack(1).pack("x").pack(3);
+	packer.packMapHeader(1).pack("key").pack(std::vector<int>(2, 5));
+
+	// A string is not an int, even inside a container
+	Unpacker unpacker(packer.data(), packer.size());
+	std::vector<int> vec;
+	EXPECT_THROW(unpacker >> vec, unpack_exception);
+
+	std::stringstream ss(std::string(packer.data(), packer.size()));
+	Unpacker streamUnpacker(ss);
+	std::list<int> list;
+	EXPECT_THROW(streamUnpacker >> list, unpack_exception);
+
+	Unpacker mapUnpacker(packer.data(), packer.size());
+	mapUnpacker.skip();
+	std::map<std::string, int> map;
+	EXPECT_THROW(mapUnpacker >> map, unpack_exception);
+
+	// Outside containers a mismatched scalar is still consumed
+	Unpacker scalarUnpacker(packer.data() + 2, packer.size() - 2);
+	int value = 42;
+	scalarUnpacker >> value;
+	EXPECT_EQ(42, value);
+	scalarUnpacker >> value;
+	EXPECT_EQ(3, value);
+}
+
+TEST(ContainerUnpack, maps)
+{
+	std::map<std::string, std::vector<int> > input;
+	input["a"] = std::vector<int>(3, 3);
+	input["b"] = std::vector<int>(100, -1);
+	std::multimap<int, double> multi;
+	multi.insert(std::make_pair(1, 1.5));
+	multi.insert(std::make_pair(1, 2.5));
+
+	BufferPacker<> packer;
+	packer.pack(input).pack(multi).pack(input);
+
+	Unpacker unpacker(packer.data(), packer.size());
+	std::map<std::string, std::vector<int> > output;
+	std::multimap<int, double> multiOutput;
+	unpacker >> output >> multiOutput;
+	EXPECT_TRUE(input == output);
+	EXPECT_TRUE(multi == multiOutput);
+
+	// A map is not an array
+	std::vector<int> vec;
+	EXPECT_THROW(unpacker >> vec, unpack_exception);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+template<typename T>
+void expectPackedSize(const T& value)
+{
+	BufferPacker<> packer;
+	packer.pack(value);
+	EXPECT_EQ(packer.size(), Packer::packedSize(value));
+}
+
+class Point : public Parcelable
+{
+public:
+	Point(int x = 0, int y = 0) : x_(x), y_(y) {}
+
+	bool operator==(const Point& other) const {
+		return x_ == other.x_ && y_ == other.y_;
+	}
+
+protected:
+	void pack(Packer& packer) const {
+		packer.pack(x_).pack(y_);
+	}
+
+	void unpack(Unpacker& unpacker) {
+		unpacker >> x_ >> y_;
+	}
+
+private:
+	int x_, y_;
+};
+
+TEST(PackedSize, parcelable)
+{
+	Point point(1000, -1);
+	const Parcelable& parcel = point;
+	expectPackedSize(parcel);
+	EXPECT_EQ(4u, Packer::packedSize(parcel));
+}
+
+TEST(PackedSize, matches_output)
+{
+	expectPackedSize(0);
+	expectPackedSize(-33);
+	expectPackedSize((int64_t) 1 << 40);
+	expectPackedSize(1.5f);
+	expectPackedSize(std::string(40000, 's'));
+	expectPackedSize(std::vector<double>(1000, 0.1));
+	expectPackedSize(std::vector<int>(1000, 12345));
+
+	std::map<std::string, std::vector<int> > value;
+	value["first"] = std::vector<int>(10, 1);
+	value["second"] = std::vector<int>(70000, -70000);
+	expectPackedSize(value);
+
+	SizePacker sizePacker;
+	sizePacker.pack(value).pack(1).pack(value);
+	EXPECT_EQ(2 * Packer::packedSize(value) + 1, sizePacker.size());
+}
+
+//////////////////////////////////////////////////////////////////////
+
+struct Sample
+{
+	int id;
+	double value;
+	std::string name;
+
+	MSGPACK_FIELDS(id, value, name)
+
+	bool operator==(const Sample& other) const {
+		return id == other.id && value == other.value && name == other.name;
+	}
+};
+
+struct Frame
+{
+	std::string source;
+	std::vector<Sample> samples;
+	std::map<std::string, int> tags;
+
+	MSGPACK_FIELDS(source, samples, tags)
+};
+
+TEST(Fields, round_trip)
+{
+	Frame input;
+	input.source = "sensor";
+	for (int i = 0; i < 20; i++) {
+		Sample sample;
+		sample.id = i * 1000;
+		sample.value = i * 0.5;
+		sample.name.assign(i, 'n');
+		input.samples.push_back(sample);
+	}
+	input.tags["a"] = 1;
+
+	BufferPacker<> packer;
+	packer << input;
+
+	// Fields are packed as a fix array
+	EXPECT_EQ((char) (bm::MP_FIXARRAY | 3), packer.data()[0]);
+	EXPECT_EQ(packer.size(), Packer::packedSize(input));
+
+	Frame output;
+	Unpacker unpacker(packer.data(), packer.size());
+	unpacker >> output;
+	EXPECT_EQ(input.source, output.source);
+	EXPECT_TRUE(input.samples == output.samples);
+	EXPECT_TRUE(input.tags == output.tags);
+
+	Unpacker mismatch(packer.data(), packer.size());
+	Sample sample;
+	EXPECT_THROW(mismatch >> sample, unpack_exception);
+}
+
+TEST(Parcelable, generic_pack_unpack)
+{
+	std::vector<Point> input;
+	input.push_back(Point(1, 2));
+	input.push_back(Point(-300, 70000));
+
+	BufferPacker<> packer;
+	packer << input;
+
+	std::vector<Point> output;
+	Unpacker unpacker(packer.data(), packer.size());
+	unpacker >> output;
+	EXPECT_TRUE(input == output);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+TEST(MappedReader, iterate_records)
+{
+	char path[] = "/tmp/msgpack-lite_testXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	std::string blob(100000, 'r');
+	{
+		std::ofstream out(path, std::ios::binary);
+		Packer packer(out);
+		for (int i = 0; i < 100; i++)
+			packer.pack(i).pack(blob);
+	}
+
+	MappedReader reader(path);
+	std::size_t resume = 0;
+	int count = 0;
+	int intVal = -1;
+	while (reader.next(intVal)) {
+		EXPECT_EQ(count, intVal);
+		if (count == 50)
+			resume = reader.offset();
+		RawRef raw;
+		ASSERT_TRUE(reader.next(raw));
+		EXPECT_EQ(blob.size(), raw.size);
+		EXPECT_TRUE(raw.data > reader.data() && raw.data < reader.data() + reader.size());
+		count++;
+	}
+	EXPECT_EQ(100, count);
+	EXPECT_TRUE(reader.eof());
+
+	MappedReader resumed(path, resume);
+	Object* obj = 0;
+	ASSERT_TRUE(resumed.skip());
+	ASSERT_TRUE(resumed.next(obj));
+	EXPECT_EQ(51, obj->getImpl<INT8>().getValue());
+	delete obj;
+	EXPECT_THROW(resumed.seek(reader.size() + 1), unpack_exception);
+	EXPECT_THROW(MappedReader past(path, reader.size() + 1), unpack_exception);
+
+	// Seeking keeps the settings of the Unpacker
+	KeyCache keys;
+	resumed.unpacker().setKeyCache(&keys);
+	resumed.seek(resume);
+	EXPECT_EQ(&keys, resumed.unpacker().getKeyCache());
+	ASSERT_TRUE(resumed.skip());
+	ASSERT_TRUE(resumed.next(intVal));
+	EXPECT_EQ(51, intVal);
+
+	std::remove(path);
+	EXPECT_THROW(MappedReader missing(path), unpack_exception);
+}
+
+TEST(RecordIndex, parallel_decode)
+{
+	BufferPacker<> packer;
+	std::map<std::string, int> record;
+	for (int i = 0; i < 1000; i++) {
+		record["id"] = i;
+		record["size"] = i * 1000;
+		packer.pack(record);
+	}
+
+	char path[] = "/tmp/msgpack-lite_testXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	RecordIndex index;
+	EXPECT_FALSE(index.load(path, packer.data(), packer.size()));
+	index.open(path, packer.data(), packer.size());
+	ASSERT_EQ(1000u, index.size());
+
+	RecordIndex loaded;
+	EXPECT_TRUE(loaded.load(path, packer.data(), packer.size()));
+	EXPECT_FALSE(loaded.load(path, packer.data(), packer.size() + 1));
+
+	// Data rewritten with the same length does not match the index
+	std::string rewritten(packer.data(), packer.size());
+	rewritten[rewritten.size() / 2] ^= 1;
+	EXPECT_FALSE(loaded.load(path, rewritten.data(), rewritten.size()));
+	EXPECT_TRUE(loaded.load(path, packer.data(), packer.size()));
+	std::remove(path);
+	ASSERT_EQ(index.size(), loaded.size());
+	EXPECT_EQ(index.offset(999), loaded.offset(999));
+
+	std::vector<int> ids(index.size(), -1);
+	forEachRecord(packer.data(), loaded, [&](Unpacker& unpacker, std::size_t i) {
+		std::map<std::string, int> value;
+		unpacker.unpack(value);
+		ids[i] = value["id"];
+	}, 4);
+	for (int i = 0; i < 1000; i++)
+		EXPECT_EQ(i, ids[i]);
+
+	EXPECT_THROW(forEachRecord(packer.data(), loaded, [](Unpacker& unpacker, std::size_t) {
+		std::string value;
+		unpacker.unpack(value);
+	}, 4), unpack_exception);
+}
+
+TEST(ParallelPack, matches_sequential)
+{
+	std::vector<std::map<std::string, double> > rows(5000);
+	for (std::size_t i = 0; i < rows.size(); i++) {
+		rows[i]["id"] = i;
+		rows[i]["value"] = i * 0.5;
+		if (i % 1000 == 0)
+			rows[i][std::string(2000, 'k')] = -1;
+	}
+
+	BufferPacker<> expected;
+	expected.pack(rows);
+
+	for (unsigned threads = 1; threads <= 4; threads += 3) {
+		for (std::size_t grain = 0; grain < 1000; grain += 333) {
+			SegmentPacker segments(256, 1024);
+			segments.pack("before");
+			packParallel(segments, rows.begin(), rows.end(), threads, grain);
+			segments.pack("after");
+
+			std::stringstream ss;
+			segments.flush(ss);
+			BufferPacker<> sequential;
+			sequential.pack("before").pack(rows).pack("after");
+			EXPECT_EQ(std::string(sequential.data(), sequential.size()), ss.str());
+
+			BufferPacker<> contiguous;
+			packParallel(contiguous, rows.begin(), rows.end(), threads, grain);
+			EXPECT_EQ(std::string(expected.data(), expected.size()),
+				std::string(contiguous.data(), contiguous.size()));
+
+			// The spliced elements belong to the array header
+			BufferPacker<> open;
+			open.beginArray();
+			packParallel(open, rows.begin(), rows.end(), threads, grain);
+			open.pack(1);
+			open.endArray();
+			Unpacker unpacker(open.data(), open.size());
+			EXPECT_EQ(2u, unpacker.unpackArrayHeader());
+		}
+	}
+
+	std::vector<int> none;
+	BufferPacker<> empty;
+	packParallel(empty, none.begin(), none.end());
+	ASSERT_EQ(1u, empty.size());
+	EXPECT_EQ((char) 0x90, empty.data()[0]);
+
+	char small[64];
+	BufferPacker<char*> tiny(small, sizeof(small));
+	EXPECT_THROW(packParallel(tiny, rows.begin(), rows.end(), 2), pack_exception);
+}
+
+TEST(LogWriter, compressed_blocks)
+{
+	char path[] = "/tmp/msgpack-lite_testXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	BufferPacker<> plain;
+	{
+		std::ofstream out(path, std::ios::binary);
+		LogWriter writer(out, 4096);
+		for (int i = 0; i < 2000; i++) {
+			std::map<std::string, int> record;
+			record["timestamp"] = 1000000 + i;
+			record["status"] = 200;
+			record["bytes"] = i % 17;
+			writer.write(record);
+			plain.pack(record);
+		}
+		writer.write(std::string(100000, 'z'));
+		EXPECT_GT(writer.blocks(), 2u);
+	}
+
+	MappedReader file(path);
+	EXPECT_LT(file.size() * 3, plain.size());
+
+	LogReader log(file.data(), file.size());
+	ASSERT_EQ(2001u, log.records());
+	EXPECT_EQ(0u, log.firstRecord(0));
+	EXPECT_EQ(log.records(0), log.firstRecord(1));
+
+	std::vector<int> seen(log.records(), 0);
+	log.forEach([&](Unpacker& unpacker, std::size_t i) {
+		if (i == 2000) {
+			RawRef raw;
+			unpacker.unpack(raw);
+			EXPECT_EQ(100000u, raw.size);
+		} else {
+			std::map<std::string, int> record;
+			unpacker.unpack(record);
+			EXPECT_EQ(1000000 + (int) i, record["timestamp"]);
+		}
+		seen[i]++;
+	});
+	EXPECT_EQ(seen, std::vector<int>(log.records(), 1));
+
+	std::vector<std::atomic<int> > counts(log.records());
+	forEachRecord(log, [&](Unpacker& unpacker, std::size_t i) {
+		unpacker.skip();
+		counts[i]++;
+	}, 4);
+	for (std::size_t i = 0; i < counts.size(); i++)
+		EXPECT_EQ(1, counts[i].load());
+
+	// Change one of the literals which start the first block
+	std::vector<char> corrupted(file.data(), file.data() + file.size());
+	corrupted[8 + 20 + 5] ^= 0x01;
+	LogReader broken(&corrupted[0], corrupted.size());
+	std::vector<char> buffer;
+	EXPECT_THROW(broken.block(0, buffer), unpack_exception);
+	EXPECT_NO_THROW(broken.block(1, buffer));
+	EXPECT_THROW(forEachRecord(broken, [](Unpacker& unpacker, std::size_t) {
+		unpacker.skip();
+	}, 2), unpack_exception);
+
+	corrupted[8 + 16] = 9;
+	EXPECT_THROW(LogReader(&corrupted[0], corrupted.size()).block(0, buffer), unpack_exception);
+	EXPECT_THROW(LogReader(file.data(), file.size() - 1), unpack_exception);
+	EXPECT_THROW(LogReader(file.data(), file.size(), 1024).block(0, buffer), unpack_exception);
+
+	// An empty index claiming 2^61 blocks, whose size in bytes wraps to 0
+	std::string huge("MPLLOG01");
+	char trailer[16];
+	detail::store_network<uint64_t>(trailer, 8);
+	detail::store_network<uint64_t>(trailer + 8, uint64_t(1) << 61);
+	huge.append(trailer, sizeof(trailer)).append("MPLLOG01");
+	ASSERT_EQ(32u, huge.size());
+	EXPECT_THROW(LogReader(huge.data(), huge.size()), unpack_exception);
+
+	std::stringstream empty;
+	LogWriter(empty).close();
+	std::string header = empty.str();
+	EXPECT_EQ(0u, LogReader(header.data(), header.size()).records());
+
+	std::remove(path);
+}
+
+TEST(ThreadLocal, reuse_and_release)
+{
+	std::vector<int> values(1000, 70000);
+	const char* buffer = 0;
+	{
+		LocalPacker packer;
+		packer->pack(values);
+		buffer = packer->data();
+	}
+	{
+		LocalPacker packer(16);
+		EXPECT_EQ(0u, packer->size());
+		packer->pack(values);
+		EXPECT_EQ(buffer, packer->data());
+
+		// Nested leases get their own instance
+		LocalPacker nested;
+		EXPECT_NE(&*packer, &*nested);
+	}
+	{
+		LocalPacker packer;
+		LocalPacker nested;
+		EXPECT_TRUE(packer->capacity() == 0 || nested->capacity() == 0);
+	}
+
+	std::thread other([&]() {
+		LocalPacker packer;
+		EXPECT_EQ(0u, packer->capacity());
+	});
+	other.join();
+
+	BufferPacker<> data;
+	data.pack(values);
+	{
+		LocalArena arena;
+		Unpacker unpacker(data.data(), data.size());
+		unpacker.unpack(*arena);
+		EXPECT_GT(arena->capacity(), 0u);
+	}
+	{
+		LocalArena arena(0);
+		EXPECT_GT(arena->capacity(), 0u);
+	}
+	{
+		LocalArena arena;
+		EXPECT_EQ(0u, arena->capacity());
+	}
+}
+
+TEST(KeyCache, shared_map_keys)
+{
+	std::map<std::string, int> first;
+	first["id"] = 1;
+	first["name"] = 2;
+	first[std::string(40, 'k')] = 3;
+
+	BufferPacker<> packer;
+	packer.pack(first);
+	packer.pack(first);
+
+	KeyCache keys;
+	for (int zeroCopy = 0; zeroCopy < 2; zeroCopy++)
+	{
+		Unpacker unpacker(packer.data(), packer.size(), zeroCopy != 0);
+		unpacker.setKeyCache(&keys);
+
+		Object* a = unpacker.unpack();
+		Object* b = unpacker.unpack();
+		const Map& mapA = (const Map&) *a;
+		const Map& mapB = (const Map&) *b;
+		ASSERT_EQ(3u, mapA.size());
+
+		for (std::size_t i = 0; i < mapA.size(); i++)
+		{
+			const Raw* key = (const Raw*) mapA[i].first;
+			if (key->size() <= keys.maxLength())
+			{
+				EXPECT_TRUE(key->isShared());
+				EXPECT_EQ(key, mapB[i].first);
+			}
+			else
+			{
+				EXPECT_FALSE(key->isShared());
+				EXPECT_NE(key, mapB[i].first);
+			}
+		}
+		EXPECT_EQ(2u, keys.size());
+		EXPECT_EQ(mapA.find("name"), mapA[2].second);
+		EXPECT_EQ(keys.find("name"), mapB[2].first);
+		EXPECT_EQ(2, mapB[2].second->getImpl<INT8>().getValue());
+
+		delete a;
+		delete b;
+	}
+
+	// Streams and full caches
+	std::stringstream ss(std::string(packer.data(), packer.size()));
+	Unpacker unpacker(ss);
+	KeyCache small(1);
+	unpacker.setKeyCache(&small);
+
+	Object* obj = unpacker.unpack();
+	const Map& map = (const Map&) *obj;
+	EXPECT_EQ(small.find("id"), map[0].first);
+	EXPECT_FALSE(((const Raw*) map[2].first)->isShared());
+	EXPECT_EQ(std::string("name"), (std::string) *(const Raw*) map[2].first);
+	EXPECT_EQ(1u, small.size());
+	delete obj;
+
+	EXPECT_EQ((Object*) 0, small.intern("other", 5));
+
+	Arena arena;
+	obj = unpacker.unpack(arena);
+	EXPECT_EQ(3u, ((const Map&) *obj).size());
+	EXPECT_EQ(small.find("id"), ((const Map&) *obj)[0].first);
+}
+
+TEST(Fragment, splice_pre_encoded)
+{
+	std::map<std::string, int> envelope;
+	envelope["version"] = 3;
+	envelope["schema"] = 7;
+
+	static const FixRaw name = MSGPACK_FIXRAW("name");
+	constexpr FixRaw empty = MSGPACK_FIXRAW("");
+	static_assert(empty.header == 0xa0 && empty.length == 0, "FIXRAW built at compile time");
+
+	BufferPacker<> expected;
+	expected.packArrayHeader(4);
+	expected.pack(envelope);
+	expected.pack(std::string("name"));
+	expected.pack(std::string());
+	expected.pack(42);
+
+	const Fragment fragment(envelope);
+	BufferPacker<> packer;
+	packer.packArrayHeader(4);
+	packer.pack(fragment);
+	packer.pack(name);
+	packer.pack(empty);
+	packer.pack(42);
+	EXPECT_EQ(std::string(expected.data(), expected.size()), std::string(packer.data(), packer.size()));
+
+	// Fragments count as a single element
+	BufferPacker<> compact;
+	compact.beginArray();
+	compact.pack(fragment);
+	compact.pack(name);
+	compact.pack(empty);
+	compact.pack(42);
+	compact.endArray(true);
+	EXPECT_EQ(std::string(expected.data(), expected.size()), std::string(compact.data(), compact.size()));
+
+	std::vector<Fragment> repeated(3, fragment);
+	BufferPacker<> list;
+	list.pack(repeated);
+	Unpacker unpacker(list.data(), list.size());
+	std::vector<std::map<std::string, int> > envelopes;
+	unpacker.unpack(envelopes);
+	ASSERT_EQ(3u, envelopes.size());
+	EXPECT_EQ(envelope, envelopes[2]);
+
+	// Streams and small buffers
+	std::stringstream ss;
+	Packer stream(ss);
+	stream.pack(name);
+	char small[3];
+	BufferPacker<char*> tiny(small, sizeof(small));
+	EXPECT_THROW(tiny.pack(name), pack_exception);
+	EXPECT_EQ(std::string("\xa4name"), ss.str());
+
+	EXPECT_EQ(1u, Fragment().size());
+
+	const Fragment copy = Fragment::encoded(fragment.data(), fragment.size());
+	EXPECT_EQ(std::string(fragment.data(), fragment.size()), std::string(copy.data(), copy.size()));
+	EXPECT_THROW(Fragment::encoded(list.data(), 1), pack_exception);
+	EXPECT_THROW(Fragment::encoded(expected.data() + 1, expected.size() - 1), pack_exception);
+}
+
+//! Keeps the Stats of every message recorded
+class MessageLog : public StatsRecorder
+{
+  public:
+
+	MessageLog() : begun(0) {}
+
+	std::size_t begun;
+	std::vector<Stats> messages;
+
+  protected:
+
+	virtual void onBegin()
+	{
+		begun++;
+	}
+
+	virtual void onMessage(const Stats& message)
+	{
+		messages.push_back(message);
+	}
+};
+
+TEST(Stats, record_messages)
+{
+	std::map<std::string, std::vector<int> > nested;
+	nested["a"] = std::vector<int>(3, 1);
+	nested["b"] = std::vector<int>();
+
+	BufferPacker<> packer;
+	packer.pack(nested);
+	packer.pack(2.5);
+	packer.pack(std::string("raw"));
+
+	MessageLog log;
+	Unpacker unpacker(packer.data(), packer.size());
+	unpacker.setStats(&log);
+	EXPECT_EQ(&log, unpacker.getStats());
+
+	Object* obj = unpacker.unpack();
+	double d;
+	unpacker.unpack(d);
+	unpacker.skip();
+	delete obj;
+
+	ASSERT_EQ(3u, log.messages.size());
+	EXPECT_EQ(3u, log.begun);
+
+	const Stats& first = log.messages[0];
+	EXPECT_EQ(1u, first.messages);
+	EXPECT_EQ(Packer::packedSize(nested), first.bytes);
+	EXPECT_EQ(1u, first.values[MAP]);
+	EXPECT_EQ(2u, first.values[ARRAY]);
+	EXPECT_EQ(2u, first.values[RAW]);
+	EXPECT_EQ(3u, first.values[INT8]);
+	EXPECT_EQ(2u, first.maxDepth);
+	EXPECT_EQ(3u, first.maxSize);
+	EXPECT_EQ(8u, first.objects);
+
+	EXPECT_EQ(1u, log.messages[1].values[DOUBLE]);
+	EXPECT_EQ(0u, log.messages[1].objects);
+	EXPECT_EQ(4u, log.messages[2].bytes);
+
+	EXPECT_EQ(3u, log.total().messages);
+	EXPECT_EQ(packer.size(), log.total().bytes);
+	EXPECT_EQ(3u, log.total().values[RAW]);
+
+	// Streams give the same figures, failed messages are not recorded
+	std::stringstream ss(std::string(packer.data(), packer.size() - 1));
+	Unpacker stream(ss);
+	MessageLog streamLog;
+	stream.setStats(&streamLog);
+	std::map<std::string, std::vector<int> > copy;
+	stream.unpack(copy).skip();
+	EXPECT_THROW(stream.skip(), unpack_exception);
+	ASSERT_EQ(2u, streamLog.messages.size());
+	EXPECT_EQ(first.bytes, streamLog.messages[0].bytes);
+	EXPECT_EQ(first.values[INT8], streamLog.messages[0].values[INT8]);
+	EXPECT_EQ(0u, streamLog.messages[0].objects);
+
+	// Outgoing messages
+	StatsRecorder out;
+	out.record(packer.data(), packer.size());
+	EXPECT_EQ(1u, out.total().messages);
+	EXPECT_EQ(packer.size(), out.total().bytes);
+	EXPECT_EQ(1u, out.total().values[DOUBLE]);
+	EXPECT_THROW(out.record(packer.data(), 2), unpack_exception);
+}
+
+TEST(Validator, frame_messages)
+{
+	std::vector<int> ints;
+	for (int i = 0; i < 100; i++)
+		ints.push_back(i % 7 == 6 ? 1000 : (i % 3 ? i : -(i % 32)));
+	std::map<std::string, std::vector<int> > nested;
+	nested["ints"] = ints;
+	nested["none"] = std::vector<int>();
+
+	BufferPacker<> packer;
+	packer.pack(nested);
+	std::size_t first = packer.size();
+	packer.pack(std::string(300, 'x')).pack(-1.5);
+
+	Validator validator;
+	EXPECT_EQ(first, validator.validate(packer.data(), packer.size()));
+	for (std::size_t i = 0; i < first; i++)
+		EXPECT_EQ(0u, validator.validate(packer.data(), i));
+	EXPECT_EQ(first, validator.validate(packer.data(), first));
+	EXPECT_EQ(303u, validator.validate(packer.data() + first, packer.size() - first));
+	EXPECT_EQ(9u, validator.validate(packer.data() + first + 303, 9));
+
+	// Resuming from the state of the previous calls
+	for (std::size_t step = 1; step < 40; step += 13) {
+		Validator::State state;
+		std::size_t length = 0;
+		for (std::size_t end = step; length == 0 && end < packer.size() + step; end += step)
+			length = validator.validate(packer.data(), std::min(end, packer.size()), state);
+		EXPECT_EQ(first, length);
+		EXPECT_EQ(first, state.checked());
+		state.reset();
+		EXPECT_EQ(303u, validator.validate(packer.data() + first, packer.size() - first, state));
+	}
+
+	// Long runs of fixnums
+	BufferPacker<> run;
+	run.pack(std::vector<int>(1000, -3));
+	EXPECT_EQ(run.size(), validator.validate(run.data(), run.size()));
+	EXPECT_EQ(0u, validator.validate(run.data(), run.size() - 1));
+
+	// Malformed data and limits
+	const char invalid[] = { (char) 0x92, 0x01, (char) 0xc1 };
+	EXPECT_THROW(validator.validate(invalid, sizeof(invalid)), unpack_exception);
+
+	const char hugeRaw[] = { (char) 0xdb, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, 'x' };
+	EXPECT_EQ(0u, validator.validate(hugeRaw, sizeof(hugeRaw)));
+	EXPECT_THROW(Validator(64, 1024).validate(hugeRaw, sizeof(hugeRaw)), unpack_exception);
+
+	const char hugeArray[] = { (char) 0xdd, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff };
+	EXPECT_THROW(Validator(64, 1024).validate(hugeArray, sizeof(hugeArray)), unpack_exception);
+
+	EXPECT_EQ(first, Validator(2, first).validate(packer.data(), packer.size()));
+	EXPECT_THROW(Validator(1).validate(packer.data(), packer.size()), unpack_exception);
+	EXPECT_THROW(Validator(2, first - 1).validate(packer.data(), packer.size()), unpack_exception);
+
+	std::string deep(100, (char) 0x91);
+	deep += (char) 0xc0;
+	EXPECT_EQ(deep.size(), Validator(100).validate(deep.data(), deep.size()));
+	Validator::State deepState;
+	EXPECT_EQ(0u, Validator(100).validate(deep.data(), 50, deepState));
+	EXPECT_EQ(deep.size(), Validator(100).validate(deep.data(), deep.size(), deepState));
+	EXPECT_THROW(validator.validate(deep.data(), deep.size()), unpack_exception);
+}
+
+TEST(LazyDocument, on_demand_access)
+{
+	std::map<std::string, std::vector<double> > series;
+	series["cpu"] = std::vector<double>(200, 0.5);
+	series["mem"].push_back(1024.0);
+	series["mem"].push_back(2048.0);
+
+	BufferPacker<> packer;
+	packer.packMapHeader(3);
+	packer.pack("host").pack("node-1");
+	packer.pack("count").pack(3);
+	packer.pack("series").pack(series);
+	packer.pack(true);
+
+	LazyDocument doc(packer.data(), packer.size());
+	LazyValue root = doc.root();
+	ASSERT_EQ(MAP, root.getType());
+	EXPECT_EQ(3u, root.size());
+
+	EXPECT_EQ(3, root.find("count").as<int>());
+	EXPECT_EQ(3.0, root.find("count").as<double>());
+	RawRef host = root.find(std::string("host")).getRaw();
+	EXPECT_EQ("node-1", std::string(host.data, host.size));
+	EXPECT_TRUE(host.data > packer.data() && host.data < packer.data() + packer.size());
+	EXPECT_FALSE(root.find("missing").isValid());
+
+	LazyValue mem = root.find("series").find("mem");
+	ASSERT_EQ(ARRAY, mem.getType());
+	ASSERT_EQ(2u, mem.size());
+	EXPECT_EQ(2048.0, mem[1].as<double>());
+	EXPECT_EQ(DOUBLE, mem[1].getType());
+	EXPECT_THROW(mem[2], std::out_of_range);
+	EXPECT_THROW(mem.key(0), std::bad_cast);
+	EXPECT_THROW(mem.as<int>(), std::bad_cast);
+
+	std::vector<double> cpu;
+	root.value(2).find("cpu").unpack(cpu);
+	EXPECT_EQ(series["cpu"], cpu);
+	std::string key;
+	root.key(2).unpack(key);
+	EXPECT_EQ("series", key);
+
+	Object* obj = root.value(1).unpack();
+	EXPECT_EQ(3, obj->getImpl<INT8>().getValue());
+	delete obj;
+}
+
+TEST(LazyDocument, truncated_document)
+{
+	BufferPacker<> packer;
+	packer.packMapHeader(2);
+	packer.pack("host").pack(std::string(40, 'h'));
+	packer.pack("load").pack(0.25);
+
+	LazyDocument whole(packer.data(), packer.size());
+	EXPECT_EQ(40u, whole.root().find("host").getRaw().size);
+
+	// Every access to a truncated document throws an unpack_exception
+	for (std::size_t length = 0; length < packer.size(); length++)
+	{
+		LazyDocument doc(packer.data(), length);
+		std::size_t failures = 0;
+		try
+		{
+			doc.root().find("host").getRaw();
+		}
+		catch (const unpack_exception&)
+		{
+			failures++;
+		}
+		try
+		{
+			doc.root().find("load").as<double>();
+		}
+		catch (const unpack_exception&)
+		{
+			failures++;
+		}
+		EXPECT_EQ(2u, failures) << length;
+	}
+
+	BufferPacker<> raw;
+	raw.pack(std::string(40, 'r'));
+	LazyDocument doc(raw.data(), raw.size() - 1);
+	EXPECT_THROW(doc.root().getRaw(), unpack_exception);
+}
+
+TEST(Skip, skip_and_seek)
+{
+	std::map<std::string, std::vector<std::string> > route;
+	route["a"] = std::vector<std::string>(3, std::string(70000, 'a'));
+	route["destination"] = std::vector<std::string>(1, "b");
+	route["z"] = std::vector<std::string>(2, "c");
+
+	std::stringstream stream;
+	Packer packer(stream);
+	packer.pack(route).pack(1.5).pack(route).pack(route).pack(7);
+	std::string data = stream.str();
+
+	Unpacker streamUnpacker(stream);
+	Unpacker regionUnpacker(data.data(), data.size());
+	Unpacker* unpackers[] = { &streamUnpacker, &regionUnpacker };
+	for (int i = 0; i < 2; i++) {
+		Unpacker& unpacker = *unpackers[i];
+		double d = 0;
+		unpacker.skip().unpack(d);
+		EXPECT_EQ(1.5, d);
+
+		ASSERT_TRUE(unpacker.seek("destination"));
+		std::vector<std::string> value;
+		unpacker.unpack(value);
+		EXPECT_EQ(route["destination"], value);
+		unpacker.skip().skip();
+
+		EXPECT_FALSE(unpacker.seek(std::string("missing")));
+		int last = 0;
+		unpacker.unpack(last);
+		EXPECT_EQ(7, last);
+	}
+	EXPECT_THROW(regionUnpacker.skip(), unpack_exception);
+
+	// Truncated raw data is not skipped over
+	std::stringstream raw;
+	Packer(raw).pack(std::string(70000, 'a'));
+	std::stringstream truncated(raw.str().substr(0, 1000));
+	Unpacker truncatedUnpacker(truncated);
+	EXPECT_THROW(truncatedUnpacker.skip(), unpack_exception);
+}
+
+TEST(Skip, seek_past_keys_of_any_type)
+{
+	std::vector<std::vector<int> > nested(2, std::vector<int>(3, 70000));
+	std::map<std::string, int> inner;
+	inner["x"] = 1;
+
+	std::stringstream stream;
+	Packer packer(stream);
+	packer.packMapHeader(5);
+	packer.pack((const char*) 0).pack(1);
+	packer.pack(nested).pack(inner);
+	packer.pack(inner).pack(nested);
+	packer.pack(2.5).pack("x");
+	packer.pack("x").pack(2);
+	packer.pack(9);
+	std::string data = stream.str();
+
+	Unpacker streamUnpacker(stream);
+	Unpacker regionUnpacker(data.data(), data.size());
+	Unpacker* unpackers[] = { &streamUnpacker, &regionUnpacker };
+	for (int i = 0; i < 2; i++) {
+		Unpacker& unpacker = *unpackers[i];
+		ASSERT_TRUE(unpacker.seek("x"));
+		int value = 0;
+		unpacker.unpack(value);
+		EXPECT_EQ(2, value);
+		unpacker.unpack(value);
+		EXPECT_EQ(9, value);
+	}
+
+	// Keys which are not RAW never match
+	BufferPacker<> nilKeys;
+	nilKeys.packMapHeader(1).pack((const char*) 0).pack(1);
+	nilKeys.pack(3);
+	Unpacker unpacker(nilKeys.data(), nilKeys.size());
+	EXPECT_FALSE(unpacker.seek(""));
+	int value = 0;
+	unpacker.unpack(value);
+	EXPECT_EQ(3, value);
+}
+
+TEST(IncrementalUnpacker, byte_by_byte)
+{
+	std::map<std::string, std::vector<int> > value;
+	value["first"] = std::vector<int>(10, 1);
+	value["second"] = std::vector<int>(100, 70000);
+	value["empty"];
+	std::string blob(40000, 'b');
+
+	BufferPacker<> packer;
+	packer.pack(value).pack(blob).pack(-7).pack(value);
+
+	IncrementalUnpacker unpacker;
+	std::vector<Object*> objects;
+	for (std::size_t i = 0; i < packer.size(); i++) {
+		unpacker.feed(packer.data() + i, 1);
+		Object* obj = 0;
+		while (unpacker.next(obj))
+			objects.push_back(obj);
+	}
+	EXPECT_EQ(0u, unpacker.buffered());
+	EXPECT_EQ(0u, unpacker.depth());
+
+	ASSERT_EQ(4u, objects.size());
+	for (int i = 0; i < 4; i += 3) {
+		ASSERT_EQ(MAP, objects[i]->getType());
+		Map& map = (Map&) objects[i]->getImpl<MAP>();
+		EXPECT_EQ(3u, map.size());
+		Object* second = map.find("second");
+		ASSERT_TRUE(second != 0);
+		Array& array = (Array&) second->getImpl<ARRAY>();
+		ASSERT_EQ(100u, array.size());
+		EXPECT_EQ(70000u, array[99]->getImpl<UINT32>().getValue());
+	}
+	EXPECT_EQ(blob, (std::string) (Raw&) objects[1]->getImpl<RAW>());
+	EXPECT_EQ(-7, objects[2]->getImpl<INT32>().getValue());
+
+	for (std::size_t i = 0; i < objects.size(); i++)
+		delete objects[i];
+}
+
+TEST(IncrementalUnpacker, partial_state)
+{
+	std::vector<std::string> value(3, "abc");
+	BufferPacker<> packer;
+	packer.pack(value);
+
+	IncrementalUnpacker unpacker;
+	Object* obj = 0;
+	unpacker.feed(packer.data(), packer.size() - 2);
+	EXPECT_FALSE(unpacker.next(obj));
+	EXPECT_EQ(1u, unpacker.depth());
+	EXPECT_EQ(2u, unpacker.buffered());
+
+	// Dropping the partial state does not leak
+	unpacker.reset();
+	EXPECT_EQ(0u, unpacker.depth());
+
+	const char invalid = (char) 0xc1;
+	unpacker.feed(&invalid, 1);
+	EXPECT_THROW(unpacker.next(obj), unpack_exception);
+}
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+//! Coroutine which starts right away and is never awaited
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() { return Task(); }
+		std::suspend_never initial_suspend() { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+Task session(AsyncUnpacker& unpacker, std::vector<std::string>& log)
+{
+	try
+	{
+		for (;;)
+		{
+			Object* obj = co_await unpacker.next();
+			log.push_back(obj->getType() == MAP ? "map" : "other");
+			delete obj;
+
+			std::vector<int> values = co_await unpacker.next<std::vector<int> >();
+			log.push_back(std::to_string(values.size()));
+		}
+	}
+	catch (const unpack_exception&)
+	{
+		log.push_back("closed");
+	}
+}
+
+TEST(AsyncUnpacker, await_messages)
+{
+	std::map<std::string, int> map;
+	map["key"] = 1;
+	BufferPacker<> packer;
+	for (int i = 0; i < 3; i++)
+		packer.pack(map).pack(std::vector<int>(i * 100, i));
+
+	AsyncUnpacker unpacker;
+	std::vector<std::string> log;
+	session(unpacker, log);
+	EXPECT_TRUE(unpacker.waiting());
+	EXPECT_TRUE(log.empty());
+
+	// One byte at a time, then the rest at once
+	std::size_t half = packer.size() / 2;
+	for (std::size_t i = 0; i < half; i++)
+		unpacker.feed(packer.data() + i, 1);
+	std::size_t done = log.size();
+	EXPECT_GT(done, 0u);
+	EXPECT_LT(done, 6u);
+	unpacker.feed(packer.data() + half, packer.size() - half);
+
+	std::vector<std::string> expected = { "map", "0", "map", "100", "map", "200" };
+	EXPECT_EQ(expected, log);
+	EXPECT_TRUE(unpacker.waiting());
+	EXPECT_EQ(0u, unpacker.buffered());
+
+	// Partial message when the connection is closed
+	unpacker.feed(packer.data(), 2);
+	unpacker.close();
+	EXPECT_EQ("closed", log.back());
+	EXPECT_FALSE(unpacker.waiting());
+
+	// Malformed data
+	AsyncUnpacker invalid;
+	std::vector<std::string> invalidLog;
+	session(invalid, invalidLog);
+	const char bad[] = { (char) 0xc1 };
+	invalid.feed(bad, 1);
+	ASSERT_EQ(1u, invalidLog.size());
+	EXPECT_EQ("closed", invalidLog[0]);
+}
+
+#endif
+
 TEST(Examples, example1)
 {
 Packer packer(std::cout);
@@ -289,7 +2144,7 @@ TEST(Examples, example3)
 	std::stringstream ss;
 	Unpacker unpacker(ss);
 	float floatVal;
-	unpacker >> floatVal;
+	EXPECT_THROW(unpacker >> floatVal, unpack_exception);
 }
 
 TEST(Examples, example4)